@@ -7,8 +7,12 @@ class RDP(object):
                        closed_cb=None,
                        dgram_send_cb=None,
                        data_received_cb=None,
-                       data_transmitted_cb=None):
-        self.__conn = rdp.wrapper.create_connection()
+                       data_transmitted_cb=None,
+                       max_segment_size=None):
+        if max_segment_size is None:
+            self.__conn = rdp.wrapper.create_connection()
+        else:
+            self.__conn = rdp.wrapper.create_connection(max_segment_size)
     
     def set_connected_cb(self, cb):
         rdp.wrapper.set_connected_cb(self.__conn, cb)
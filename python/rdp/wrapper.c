@@ -17,8 +17,9 @@
 
 struct py_rdp_connection_s {
     struct rdp_connection_s connection;
-    uint8_t rdp_recv_buf[RDP_MAX_SEGMENT_SIZE];
-    uint8_t rdp_outbuf[RDP_MAX_SEGMENT_SIZE];
+    uint8_t *rdp_recv_buf;
+    uint8_t *rdp_outbuf;
+    uint8_t *rdp_winbuf;
     size_t recv_len;
     size_t send_len;
     struct {
@@ -105,11 +106,24 @@ static void dgram_send_cb(struct rdp_connection_s *c, const uint8_t *d, size_t l
 
 static PyObject* py_rdp_create_connection(PyObject* self, PyObject* args)
 {
-    struct py_rdp_connection_s *conn = malloc(sizeof(struct py_rdp_connection_s));
-    if (conn == NULL)
+    int mss = RDP_MAX_SEGMENT_SIZE;
+    if (!PyArg_ParseTuple(args, "|i", &mss))
+        return NULL;
+    if (mss <= RDP_MAX_HEADER_LEN || mss % 4 != 0 || mss > RDP_SEGMENT_SIZE_LIMIT)
+    {
+        PyErr_SetString(PyExc_ValueError, "invalid max segment size");
         return NULL;
-    memset(conn, 0, sizeof(*conn));
-    rdp_init_connection(&conn->connection, conn->rdp_outbuf, conn->rdp_recv_buf);
+    }
+    // Buffers are allocated together with connection
+    size_t size = sizeof(struct py_rdp_connection_s) + 2 * mss + RDP_WINDOW_BUFFER_SIZE(mss);
+    struct py_rdp_connection_s *conn = malloc(size);
+    if (conn == NULL)
+        return PyErr_NoMemory();
+    memset(conn, 0, size);
+    conn->rdp_recv_buf = (uint8_t *)(conn + 1);
+    conn->rdp_outbuf = conn->rdp_recv_buf + mss;
+    conn->rdp_winbuf = conn->rdp_outbuf + mss;
+    rdp_init_connection(&conn->connection, conn->rdp_outbuf, conn->rdp_recv_buf, conn->rdp_winbuf, mss);
 
     conn->connected_cb = Py_None;
     conn->closed_cb = Py_None;
@@ -342,7 +356,7 @@ static PyObject* py_rdp_set_dgram_send_cb(PyObject* self, PyObject* args)
 }
 
 static PyMethodDef myMethods[] = {
-    { "create_connection", py_rdp_create_connection, METH_NOARGS, "Create connection" },
+    { "create_connection", py_rdp_create_connection, METH_VARARGS, "Create connection" },
     { "state",  py_rdp_state, METH_VARARGS, "Connection state" },
     { "listen", py_rdp_listen, METH_VARARGS, "Listen port" },
     { "connect", py_rdp_connect, METH_VARARGS, "Connect to remote host" },
@@ -1,21 +1,79 @@
 #pragma once
 
+// Default max segment size
 // Must be aligned to 4
 // Must be > 24
 #define RDP_MAX_SEGMENT_SIZE 128
 
-// Require order of packets
+// Upper limit of max segment size, given by 16-bit data length field
+#define RDP_SEGMENT_SIZE_LIMIT 65532
+
+// Path MTU probing starts from this segment size, supposed to pass any path
+#define RDP_PMTU_BASE_SIZE RDP_MAX_SEGMENT_SIZE
+
+// Path MTU search stops when the bounds are closer than this
+#define RDP_PMTU_PROBE_STEP 32
+
+// Path MTU is probed again after this time
+#define RDP_PMTU_REPROBE_TIMEOUT 600000000
+
+// Pacing: max burst, segments
+#define RDP_PACING_BURST 2
+
+// Coalescing: default max delay of small writes
+#define RDP_COALESCE_MAX_DELAY 20000
+
+// FEC: default amount of data segments protected by one parity segment
+#define RDP_FEC_GROUP_SIZE 4
+
+// FEC: max group size
+#define RDP_FEC_MAX_GROUP_SIZE 16
+
+// Require order of packets. Unordered delivery is used when both sides disable it
 #define RDP_SDM 1
 
-// Max out of order packets. Only 0 is supported
-#define RDP_MAX_OUTSTANGING 0
+// Max outstanding (unacknowledged) segments.
+// Size of the send window, advertised to the remote side in SYN
+#define RDP_MAX_OUTSTANGING 8
+
+// Segment is retransmitted without waiting for resend timeout when
+// this amount of later segments were EACKed or duplicate ACKs received
+#define RDP_DUPACK_THRESHOLD 3
+
+// Acknowledge every n-th in order segment...
+#define RDP_DELAYED_ACK_SEGMENTS 1
+
+// ...or when this time passed since the first not acknowledged segment.
+// Must be less than RDP_MIN_RESEND_TIMEOUT
+#define RDP_DELAYED_ACK_TIMEOUT 2000
+
+// Congestion window at connection start, segments
+#define RDP_CC_INITIAL_WINDOW 2
+
+// Bounds of segments queued on the path for delay based congestion control
+#define RDP_CC_DELAY_ALPHA 1
+#define RDP_CC_DELAY_BETA 3
 
 // Close timeout
 #define RDP_CLOSE_TIMEOUT 6000000
 
-// Resend timeout
+// Amount of logical channels in connection
+#define RDP_MAX_CHANNELS 4
+
+// Random initial send sequence number of connection. Seed rand()
+// with srand() to get different numbers in different runs
+#define RDP_RANDOM_ISS() (((uint32_t)rand() << 16) ^ (uint32_t)rand())
+
+// Max time graceful close waits for sent data to be acknowledged
+#define RDP_LINGER_TIMEOUT 2000000
+
+// Initial resend timeout, used until round trip time is measured
 #define RDP_RESEND_TIMEOUT 100000
 
+// Bounds of resend timeout, computed from measured round trip time
+#define RDP_MIN_RESEND_TIMEOUT 5000
+#define RDP_MAX_RESEND_TIMEOUT 4000000
+
 // Keepalive timeout
 #define RDP_KEEPALIVE_TIMEOUT 10000000
 
@@ -0,0 +1,101 @@
+#include <cycle.h>
+#include <congestion.h>
+
+static uint32_t rdp_cc_max_window(struct rdp_connection_s *conn)
+{
+    return conn->snd.max > 0 ? conn->snd.max : RDP_MAX_OUTSTANGING;
+}
+
+static void rdp_cc_grow(struct rdp_connection_s *conn, uint32_t inc)
+{
+    conn->cc.cwnd += inc;
+    if (conn->cc.cwnd > rdp_cc_max_window(conn))
+        conn->cc.cwnd = rdp_cc_max_window(conn);
+}
+
+static void rdp_cc_common_init(struct rdp_connection_s *conn)
+{
+    conn->cc.cwnd = RDP_CC_INITIAL_WINDOW;
+    conn->cc.ssthresh = RDP_MAX_OUTSTANGING;
+    conn->cc.cnt = 0;
+    conn->cc.base_rtt = -1;
+}
+
+static void rdp_cc_common_lost(struct rdp_connection_s *conn, bool timeout)
+{
+    conn->cc.ssthresh = conn->cc.cwnd / 2;
+    if (conn->cc.ssthresh < 2)
+        conn->cc.ssthresh = 2;
+    conn->cc.cwnd = timeout ? 1 : conn->cc.ssthresh;
+    conn->cc.cnt = 0;
+}
+
+// Reno
+
+static void rdp_cc_reno_acked(struct rdp_connection_s *conn, int nacked, int rtt)
+{
+    // Reno reacts only to loss
+    (void)rtt;
+    if (conn->cc.cwnd < conn->cc.ssthresh)
+    {
+        // Slow start
+        rdp_cc_grow(conn, nacked);
+        return;
+    }
+    // Congestion avoidance, +1 segment per window
+    conn->cc.cnt += nacked;
+    if (conn->cc.cnt >= conn->cc.cwnd)
+    {
+        conn->cc.cnt = 0;
+        rdp_cc_grow(conn, 1);
+    }
+}
+
+const struct rdp_cc_s rdp_cc_reno = {
+    .init = rdp_cc_common_init,
+    .acked = rdp_cc_reno_acked,
+    .lost = rdp_cc_common_lost,
+};
+
+// Delay based
+
+static void rdp_cc_delay_acked(struct rdp_connection_s *conn, int nacked, int rtt)
+{
+    if (rtt < 0)
+        rtt = conn->rtt.srtt;
+    if (rtt > 0 && (conn->cc.base_rtt < 0 || rtt < conn->cc.base_rtt))
+        conn->cc.base_rtt = rtt;
+
+    // Segments queued on the path: cwnd * (1 - base_rtt / rtt)
+    uint32_t queued = 0;
+    if (rtt > 0 && conn->cc.base_rtt > 0)
+        queued = conn->cc.cwnd * (rtt - conn->cc.base_rtt) / rtt;
+
+    if (conn->cc.cwnd < conn->cc.ssthresh)
+    {
+        if (queued > RDP_CC_DELAY_BETA)
+        {
+            // Path queue is growing, leave slow start
+            conn->cc.ssthresh = conn->cc.cwnd;
+            return;
+        }
+        rdp_cc_grow(conn, nacked);
+        return;
+    }
+
+    // Adjust once per window
+    conn->cc.cnt += nacked;
+    if (conn->cc.cnt < conn->cc.cwnd)
+        return;
+    conn->cc.cnt = 0;
+    if (queued < RDP_CC_DELAY_ALPHA)
+        rdp_cc_grow(conn, 1);
+    else if (queued > RDP_CC_DELAY_BETA && conn->cc.cwnd > 2)
+        conn->cc.cwnd--;
+}
+
+const struct rdp_cc_s rdp_cc_delay = {
+    .init = rdp_cc_common_init,
+    .acked = rdp_cc_delay_acked,
+    .lost = rdp_cc_common_lost,
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <defs.h>
+
+struct rdp_connection_s;
+
+// Congestion control algorithm, called from the send path
+struct rdp_cc_s {
+    // Connection is being established
+    void (*init)(struct rdp_connection_s *conn);
+
+    // nacked segments were acknowledged. rtt is round trip time
+    // measured by this acknowledgement or -1 if it was not measured
+    void (*acked)(struct rdp_connection_s *conn, int nacked, int rtt);
+
+    // Segment loss detected. timeout is set when loss is detected
+    // by resend timeout
+    void (*lost)(struct rdp_connection_s *conn, bool timeout);
+};
+
+// Congestion control state of connection
+struct rdp_cc_state_s {
+    // Selected algorithm, NULL if congestion control is disabled
+    const struct rdp_cc_s *ops;
+
+    // Congestion window, segments
+    uint32_t cwnd;
+
+    // Slow start threshold, segments
+    uint32_t ssthresh;
+
+    // Acknowledged segments counted for congestion avoidance
+    uint32_t cnt;
+
+    // Minimal measured round trip time
+    int base_rtt;
+};
+
+// Reno-style AIMD: slow start, additive increase, halving on loss
+extern const struct rdp_cc_s rdp_cc_reno;
+
+// Delay based: keeps amount of queued segments between
+// RDP_CC_DELAY_ALPHA and RDP_CC_DELAY_BETA
+extern const struct rdp_cc_s rdp_cc_delay;
@@ -1,6 +1,8 @@
 #include <cycle.h>
 #include <packages.h>
+#include <packages_public.h>
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 
 /*
@@ -70,56 +72,784 @@ RST,ACK |         |             |       |            |     snd ACK        |
 */
 
 static bool rdp_final_close(struct rdp_connection_s *conn);
+static void rdp_fast_retransmit(struct rdp_connection_s *conn);
+static void rdp_send_pending(struct rdp_connection_s *conn);
+static void rdp_retry(struct rdp_connection_s *conn, struct rdp_segment_s *seg);
+static void rdp_send_rst(struct rdp_connection_s *conn);
+static void rdp_send_coalesced(struct rdp_connection_s *conn, bool force);
 
 static void rdp_pkg_rcvd(struct rdp_connection_s *conn)
 {
     conn->wait_keepalive.time = 0;
 }
 
+
+// Sequence numbers are compared with serial number arithmetic,
+// so comparison works across wraparound of 2^32
+static bool rdp_seq_lt(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+static bool rdp_seq_le(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) <= 0;
+}
+
+static struct rdp_segment_s *rdp_segment(struct rdp_connection_s *conn, uint32_t seq)
+{
+    return &conn->sndq[seq % RDP_MAX_OUTSTANGING];
+}
+
+static struct rdp_rcv_segment_s *rdp_rcv_segment(struct rdp_connection_s *conn, uint32_t seq)
+{
+    return &conn->rcvq[seq % RDP_MAX_OUTSTANGING];
+}
+
+// Amount of sent and not yet acknowledged segments
+static uint32_t rdp_outstanding(struct rdp_connection_s *conn)
+{
+    return conn->snd.nxt - conn->snd.una;
+}
+
+// All data is sent and acknowledged
+static bool rdp_all_sent(struct rdp_connection_s *conn)
+{
+    int i;
+    for (i = 0; i < RDP_MAX_CHANNELS; i++)
+    {
+        if (conn->channels.ch[i].queue.len > 0)
+            return false;
+    }
+    return rdp_outstanding(conn) == 0 && conn->msg_out.data == NULL && conn->coalesce.len == 0 &&
+           conn->send_queue.ring.len == 0 && conn->stream.snd_ring.len == 0;
+}
+
+// Segment size used for sending
+static size_t rdp_segment_size(struct rdp_connection_s *conn)
+{
+    if (conn->pmtu.enabled && conn->pmtu.size > 0)
+        return conn->pmtu.size;
+    return conn->snd.mss;
+}
+
+// Receive window: amount of segments after rcv.cur which can be
+// received. Paused receiver allows only segments which it already has
+static uint32_t rdp_rcv_window(struct rdp_connection_s *conn)
+{
+    uint32_t last = conn->rcv.cur;
+    int i;
+    for (i = 0; i < RDP_MAX_OUTSTANGING; i++)
+    {
+        if (conn->rcvq[i].flag && rdp_seq_lt(last, conn->rcvq[i].seq))
+            last = conn->rcvq[i].seq;
+    }
+    uint32_t held = last - conn->rcv.cur;
+    if (conn->flow.paused)
+        return held;
+    uint32_t wnd = RDP_MAX_OUTSTANGING;
+    if (conn->stream.enabled)
+    {
+        size_t fit = rdp_ring_free(&conn->stream.rcv_ring) / rdp_max_data_size(conn);
+        if (fit < wnd)
+            wnd = fit;
+        if (wnd < held)
+            wnd = held;
+    }
+    return wnd;
+}
+
+// Send package from outbuf, which doesn't need acknowledgement
+static void rdp_send_package(struct rdp_connection_s *conn, size_t len)
+{
+    if (conn->flow.enabled)
+    {
+        conn->flow.adv = rdp_rcv_window(conn);
+        len = rdp_add_window(conn->outbuf, len, conn->flow.adv);
+    }
+    if (conn->session.remote != 0)
+        len = rdp_add_session(conn->outbuf, len, conn->session.remote);
+    if (conn->compact.enabled)
+        len = rdp_compact_encode(conn->outbuf, len);
+    conn->out_data_length = len;
+    if (conn->cbs.send)
+        conn->cbs.send(conn, conn->outbuf, len);
+}
+
+// Acknowledgement of rcv.cur is sent, nothing is pending
+static void rdp_ack_sent(struct rdp_connection_s *conn)
+{
+    conn->delayed_ack.pending = 0;
+    conn->wait_delayed_ack.flag = 0;
+}
+
+// Pacing rate, bytes per second. 0 if not limited
+static int64_t rdp_pacing_rate(struct rdp_connection_s *conn)
+{
+    if (conn->pacing.rate > 0)
+        return conn->pacing.rate;
+    if (!conn->rtt.flag || conn->rtt.srtt <= 0)
+        return 0;
+    // Window is spread over round trip time
+    int64_t wnd = conn->snd.max;
+    if (conn->cc.ops && conn->cc.cwnd < wnd)
+        wnd = conn->cc.cwnd;
+    return wnd * rdp_segment_size(conn) * 1000000 / conn->rtt.srtt;
+}
+
+static int64_t rdp_pacing_burst(struct rdp_connection_s *conn)
+{
+    return (int64_t)RDP_PACING_BURST * rdp_segment_size(conn) * 1000000;
+}
+
+static void rdp_pacing_refill(struct rdp_connection_s *conn, int dt)
+{
+    int64_t rate = rdp_pacing_rate(conn);
+    if (rate == 0)
+        conn->pacing.tokens = rdp_pacing_burst(conn);
+    else
+        conn->pacing.tokens += rate * dt;
+    if (conn->pacing.tokens > rdp_pacing_burst(conn))
+        conn->pacing.tokens = rdp_pacing_burst(conn);
+}
+
+// FEC parity is sent to remote side
+static bool rdp_fec_sending(struct rdp_connection_s *conn)
+{
+    return conn->fec.buf != NULL && conn->fec.remote_group > 0;
+}
+
+// Add sent segment to parity of group. Parity is sent after the last segment of group
+static void rdp_fec_sent(struct rdp_connection_s *conn, const struct rdp_segment_s *seg)
+{
+    // SYN,ACK is not protected
+    if (!rdp_fec_sending(conn) || seg->seq == conn->snd.iss)
+        return;
+    uint32_t group = conn->fec.group;
+    uint32_t pos = (seg->seq - conn->snd.iss - 1) % group;
+    uint8_t *pbuf = conn->fec.buf;
+    if (pos == 0)
+    {
+        memset(&conn->fec.snd.parity, 0, sizeof(conn->fec.snd.parity));
+        conn->fec.snd.len = 0;
+    }
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)seg->buf;
+    if (!hdr->nul && hdr->data_length > 0)
+    {
+        const uint8_t *data = seg->buf + hdr->header_length * 2;
+        size_t i;
+        if (hdr->data_length > conn->fec.snd.len)
+        {
+            memset(pbuf + conn->fec.snd.len, 0, hdr->data_length - conn->fec.snd.len);
+            conn->fec.snd.len = hdr->data_length;
+        }
+        for (i = 0; i < hdr->data_length; i++)
+            pbuf[i] ^= data[i];
+        conn->fec.snd.parity.len_xor ^= hdr->data_length;
+        conn->fec.snd.parity.tag_xor ^= 1 | (hdr->more << 1);
+    }
+    if (pos != group - 1 || conn->fec.snd.len == 0)
+        return;
+    conn->fec.snd.parity.group = group;
+    size_t len = rdp_build_parity_package(conn->outbuf, conn->local_port, conn->remote_port, seg->seq - pos,
+                                          &conn->fec.snd.parity, pbuf, conn->fec.snd.len);
+    // Path MTU could decrease
+    if (len == 0 || len + (conn->flow.enabled ? 2 : 0) > conn->snd.mss)
+        return;
+    rdp_send_package(conn, len);
+    conn->fec.stats.parity_sent++;
+}
+
+// Prefix data of segment with its channel and sequence number in channel
+static size_t rdp_add_channel(struct rdp_connection_s *conn, size_t len)
+{
+    struct rdp_header_s *hdr = (struct rdp_header_s *)conn->outbuf;
+    if (!conn->channels.enabled || hdr->syn || hdr->nul || hdr->rst || hdr->data_length == 0)
+        return len;
+    size_t hlen = hdr->header_length * 2;
+    struct rdp_channel_s *ch = &conn->channels.ch[conn->channels.cur];
+    memmove(conn->outbuf + hlen + RDP_CHANNEL_HEADER_LEN, conn->outbuf + hlen, len - hlen);
+    conn->outbuf[hlen] = conn->channels.cur;
+    conn->outbuf[hlen + 1] = ch->snd_seq++;
+    hdr->data_length += RDP_CHANNEL_HEADER_LEN;
+    return len + RDP_CHANNEL_HEADER_LEN;
+}
+
+// Send package from outbuf with sequence number snd.nxt.
+// The package is kept in retransmission queue until acknowledged.
+// It carries acknowledgement of rcv.cur, so pending ACK is not needed
+static void rdp_send_segment(struct rdp_connection_s *conn, size_t len)
+{
+    len = rdp_add_channel(conn, len);
+    struct rdp_segment_s *seg = rdp_segment(conn, conn->snd.nxt);
+    seg->seq = conn->snd.nxt;
+    seg->len = len;
+    memcpy(seg->buf, conn->outbuf, len);
+    seg->wait_ack.time = 0;
+    seg->wait_ack.flag = 1;
+    seg->retransmitted = 0;
+    seg->ttl = 0;
+    seg->age = 0;
+    conn->snd.nxt++;
+    if (conn->pacing.enabled)
+        conn->pacing.tokens -= (int64_t)len * 1000000;
+    rdp_ack_sent(conn);
+    rdp_send_package(conn, len);
+    rdp_fec_sent(conn, seg);
+}
+
+// Send ACK, or EACK if there are segments received out of order
+static void rdp_send_ack(struct rdp_connection_s *conn)
+{
+    uint32_t acks[RDP_MAX_OUTSTANGING];
+    size_t nacks = 0;
+    // EACK must fit into segment size of remote side
+    size_t maxacks = (rdp_segment_size(conn) - sizeof(struct rdp_header_s) - (conn->flow.enabled ? 2 : 0)) / 4;
+    size_t len;
+    uint32_t seq;
+    // Segment after rcv.cur is buffered when delivery is paused
+    for (seq = conn->rcv.cur + 1; rdp_seq_le(seq, conn->rcv.cur + RDP_MAX_OUTSTANGING) && nacks < maxacks; seq++)
+    {
+        struct rdp_rcv_segment_s *rseg = rdp_rcv_segment(conn, seq);
+        if (rseg->flag && rseg->seq == seq)
+            acks[nacks++] = seq;
+    }
+    if (nacks > 0)
+        len = rdb_build_eack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur, acks, nacks, NULL, 0);
+    else
+        len = rdp_build_ack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur, NULL, 0);
+    rdp_ack_sent(conn);
+    rdp_send_package(conn, len);
+}
+
+static bool rdp_has_out_of_order(struct rdp_connection_s *conn)
+{
+    int i;
+    for (i = 0; i < RDP_MAX_OUTSTANGING; i++)
+    {
+        if (conn->rcvq[i].flag && rdp_seq_lt(conn->rcv.cur, conn->rcvq[i].seq))
+            return true;
+    }
+    return false;
+}
+
+// Acknowledge in order segment according to delayed acknowledgement policy.
+// ACK is sent after the segment is delivered, so data sent by
+// data_received callback carries it instead of bare ACK
+static void rdp_send_delayed_ack(struct rdp_connection_s *conn)
+{
+    conn->delayed_ack.pending++;
+    if (rdp_has_out_of_order(conn))
+    {
+        rdp_send_ack(conn);
+        return;
+    }
+    if (!conn->wait_delayed_ack.flag)
+    {
+        conn->wait_delayed_ack.time = 0;
+        conn->wait_delayed_ack.flag = 1;
+    }
+}
+
+// Segment seq with dlen bytes received in order. Move rcv.cur over it and over
+// segments which were received out of order right after it. In stream mode
+// segments which don't fit receive ring stay buffered until rdp_read
+static void rdp_rcv_in_order(struct rdp_connection_s *conn, uint32_t seq, size_t dlen)
+{
+    conn->rcv.cur = seq;
+    while (true)
+    {
+        struct rdp_rcv_segment_s *rseg = rdp_rcv_segment(conn, conn->rcv.cur + 1);
+        if (!rseg->flag || rseg->seq != conn->rcv.cur + 1)
+            break;
+        if (conn->stream.enabled && dlen + rseg->len > rdp_ring_free(&conn->stream.rcv_ring))
+            break;
+        if (conn->flow.paused && rseg->len > 0)
+            break;
+        dlen += rseg->len;
+        conn->rcv.cur++;
+    }
+    conn->rcv.expect = conn->rcv.cur + 1;
+}
+
+// Store segment received out of order, or in order while delivery is paused
+static bool rdp_rcv_out_of_order(struct rdp_connection_s *conn, uint32_t seq, const uint8_t *data, size_t dlen, bool more)
+{
+    if (rdp_seq_le(seq, conn->rcv.cur) || rdp_seq_lt(conn->rcv.cur + RDP_MAX_OUTSTANGING, seq))
+        return false;
+    if (seq == conn->rcv.cur + 1 && !conn->flow.paused)
+        return false;
+    struct rdp_rcv_segment_s *rseg = rdp_rcv_segment(conn, seq);
+    if (rseg->flag && rseg->seq == seq)
+        return true;
+    rseg->seq = seq;
+    rseg->len = dlen;
+    rseg->more = more;
+    if (dlen > 0)
+        memcpy(rseg->data, data, dlen);
+    rseg->flag = 1;
+    return true;
+}
+
+// Deliver in order data to user. Fragments of message are collected
+// in message buffer and delivered when the last one is received
+static void rdp_deliver_data(struct rdp_connection_s *conn, const uint8_t *data, size_t dlen, bool more)
+{
+    if (conn->stream.enabled)
+    {
+        rdp_ring_write(&conn->stream.rcv_ring, data, dlen);
+        return;
+    }
+    // Fragmented message can't be reassembled without message buffer,
+    // it is dropped instead of delivering fragments as separate messages
+    if (conn->msg_in.buf == NULL)
+    {
+        if (more || conn->msg_in.overflow)
+            conn->msg_in.overflow = more;
+        else if (conn->cbs.data_received)
+            conn->cbs.data_received(conn, data, dlen);
+        return;
+    }
+    if (!more && conn->msg_in.len == 0 && !conn->msg_in.overflow)
+    {
+        if (conn->cbs.data_received)
+            conn->cbs.data_received(conn, data, dlen);
+        return;
+    }
+    if (conn->msg_in.len + dlen > conn->msg_in.size)
+        conn->msg_in.overflow = 1;
+    if (!conn->msg_in.overflow)
+    {
+        memcpy(conn->msg_in.buf + conn->msg_in.len, data, dlen);
+        conn->msg_in.len += dlen;
+    }
+    if (more)
+        return;
+    size_t len = conn->msg_in.len;
+    bool overflow = conn->msg_in.overflow;
+    conn->msg_in.len = 0;
+    conn->msg_in.overflow = 0;
+    if (!overflow && conn->cbs.data_received)
+        conn->cbs.data_received(conn, conn->msg_in.buf, len);
+}
+
+// Deliver data of segment in its channel. Messages and stream are
+// carried by channel 0, data of other channels goes to user at once
+static void rdp_deliver(struct rdp_connection_s *conn, const uint8_t *data, size_t dlen, bool more)
+{
+    if (!conn->channels.enabled)
+    {
+        rdp_deliver_data(conn, data, dlen, more);
+        return;
+    }
+    if (dlen < RDP_CHANNEL_HEADER_LEN || data[0] >= RDP_MAX_CHANNELS)
+        return;
+    uint8_t channel = data[0];
+    conn->channels.ch[channel].rcv_seq = data[1] + 1;
+    data += RDP_CHANNEL_HEADER_LEN;
+    dlen -= RDP_CHANNEL_HEADER_LEN;
+    if (channel == 0 && (conn->stream.enabled || conn->msg_in.buf != NULL || more || conn->msg_in.overflow))
+        rdp_deliver_data(conn, data, dlen, more);
+    else if (conn->cbs.channel_received)
+        conn->cbs.channel_received(conn, channel, data, dlen);
+    else if (conn->cbs.data_received)
+        conn->cbs.data_received(conn, data, dlen);
+}
+
+// Segment received out of order is the next one in its channel,
+// so it can be delivered without waiting for segments of other channels.
+// Stream of channel 0 is written to receive ring only in order, where
+// space of the ring is checked
+static bool rdp_channel_next(struct rdp_connection_s *conn, const uint8_t *data, size_t dlen)
+{
+    if (!conn->channels.enabled || conn->flow.paused)
+        return false;
+    if (dlen < RDP_CHANNEL_HEADER_LEN || data[0] >= RDP_MAX_CHANNELS)
+        return false;
+    if (data[0] == 0 && conn->stream.enabled)
+        return false;
+    return data[1] == conn->channels.ch[data[0]].rcv_seq;
+}
+
+// Deliver segments received out of order which became the next ones in their channels
+static void rdp_deliver_channels(struct rdp_connection_s *conn)
+{
+    bool delivered = true;
+    while (delivered)
+    {
+        int i;
+        delivered = false;
+        for (i = 0; i < RDP_MAX_OUTSTANGING; i++)
+        {
+            struct rdp_rcv_segment_s *rseg = &conn->rcvq[i];
+            if (!rseg->flag || rseg->len == 0 || rdp_seq_le(rseg->seq, conn->rcv.cur))
+                continue;
+            if (!rdp_channel_next(conn, rseg->data, rseg->len))
+                continue;
+            // Delivered now, only sequence number is kept
+            size_t len = rseg->len;
+            rseg->len = 0;
+            rdp_deliver(conn, rseg->data, len, rseg->more);
+            delivered = true;
+        }
+    }
+}
+
+// Deliver buffered segments which became in order, from seq up to rcv.cur
+static void rdp_deliver_buffered(struct rdp_connection_s *conn, uint32_t seq)
+{
+    for (; rdp_seq_le(seq, conn->rcv.cur); seq++)
+    {
+        struct rdp_rcv_segment_s *rseg = rdp_rcv_segment(conn, seq);
+        if (!rseg->flag || rseg->seq != seq)
+            continue;
+        rseg->flag = 0;
+        if (rseg->len > 0)
+            rdp_deliver(conn, rseg->data, rseg->len, rseg->more);
+    }
+}
+
+// In stream mode segment is accepted only if receive ring has space for it
+static bool rdp_rcv_space(struct rdp_connection_s *conn, size_t dlen)
+{
+    if (!conn->stream.enabled)
+        return true;
+    return dlen <= rdp_ring_free(&conn->stream.rcv_ring);
+}
+
+static void rdp_flush_received(struct rdp_connection_s *conn)
+{
+    int i;
+    for (i = 0; i < RDP_MAX_OUTSTANGING; i++)
+        conn->rcvq[i].flag = 0;
+    conn->msg_in.len = 0;
+    conn->msg_in.overflow = 0;
+}
+
+// Drop all segments from retransmission queue
+static void rdp_flush_segments(struct rdp_connection_s *conn)
+{
+    int i;
+    for (i = 0; i < RDP_MAX_OUTSTANGING; i++)
+        conn->sndq[i].wait_ack.flag = 0;
+    conn->snd.una = conn->snd.nxt;
+    conn->msg_out.data = NULL;
+    conn->coalesce.len = 0;
+    conn->wait_coalesce.flag = 0;
+    rdp_ring_clear(&conn->send_queue.ring);
+    conn->send_queue.above = 0;
+    rdp_ring_clear(&conn->stream.snd_ring);
+    for (i = 0; i < RDP_MAX_CHANNELS; i++)
+        rdp_ring_clear(&conn->channels.ch[i].queue);
+    conn->wait_linger.flag = 0;
+}
+
+static void rdp_rtt_reset(struct rdp_connection_s *conn)
+{
+    conn->rtt.srtt = 0;
+    conn->rtt.rttvar = 0;
+    conn->rtt.rto = RDP_RESEND_TIMEOUT;
+    conn->rtt.flag = 0;
+}
+
+static void rdp_cc_reset(struct rdp_connection_s *conn)
+{
+    if (conn->cc.ops && conn->cc.ops->init)
+        conn->cc.ops->init(conn);
+}
+
+static void rdp_cc_acked(struct rdp_connection_s *conn, int nacked, int rtt)
+{
+    if (nacked > 0 && conn->cc.ops && conn->cc.ops->acked)
+        conn->cc.ops->acked(conn, nacked, rtt);
+}
+
+static void rdp_cc_lost(struct rdp_connection_s *conn, bool timeout)
+{
+    if (conn->cc.ops && conn->cc.ops->lost)
+        conn->cc.ops->lost(conn, timeout);
+}
+
+// Update round trip time estimation (RFC 6298) with acknowledged segment.
+// Returns measured round trip time or -1
+static int rdp_rtt_sample(struct rdp_connection_s *conn, const struct rdp_segment_s *seg)
+{
+    // Karn's rule
+    if (seg->retransmitted)
+        return -1;
+    int r = seg->wait_ack.time;
+    if (!conn->rtt.flag)
+    {
+        conn->rtt.srtt = r;
+        conn->rtt.rttvar = r / 2;
+        conn->rtt.flag = 1;
+    }
+    else
+    {
+        int delta = conn->rtt.srtt - r;
+        if (delta < 0)
+            delta = -delta;
+        conn->rtt.rttvar = (3 * conn->rtt.rttvar + delta) / 4;
+        conn->rtt.srtt = (7 * conn->rtt.srtt + r) / 8;
+    }
+    conn->rtt.rto = conn->rtt.srtt + 4 * conn->rtt.rttvar;
+    if (conn->rtt.rto < RDP_MIN_RESEND_TIMEOUT)
+        conn->rtt.rto = RDP_MIN_RESEND_TIMEOUT;
+    if (conn->rtt.rto > RDP_MAX_RESEND_TIMEOUT)
+        conn->rtt.rto = RDP_MAX_RESEND_TIMEOUT;
+    return r;
+}
+
+// Remove segments up to ack from retransmission queue.
+// Returns amount of acknowledged segments with data. Message
+// counts as one segment, when its last fragment is acknowledged
+static int rdp_segments_acked(struct rdp_connection_s *conn, uint32_t ack)
+{
+    int completed = 0;
+    int nacked = 0;
+    const struct rdp_segment_s *last = NULL;
+    while (conn->snd.una != conn->snd.nxt && rdp_seq_le(conn->snd.una, ack))
+    {
+        struct rdp_segment_s *seg = rdp_segment(conn, conn->snd.una);
+        const struct rdp_header_s *hdr = (const struct rdp_header_s *)seg->buf;
+        if (hdr->data_length > 0 && !hdr->more)
+            completed++;
+        if (seg->wait_ack.flag)
+        {
+            last = seg;
+            nacked++;
+        }
+        seg->wait_ack.flag = 0;
+        conn->snd.una++;
+    }
+    // One measurement per acknowledgement, by the most recent segment
+    if (last != NULL)
+        rdp_cc_acked(conn, nacked, rdp_rtt_sample(conn, last));
+    return completed;
+}
+
+// Tell user about acknowledged segments
+static void rdp_send_completed(struct rdp_connection_s *conn, int completed)
+{
+    while (completed-- > 0)
+    {
+        if (conn->cbs.data_send_completed)
+            conn->cbs.data_send_completed(conn);
+    }
+}
+
+// Compact header carries only low bits of ports, so it is used
+// when both ports fit them
+static bool rdp_compact_usable(struct rdp_connection_s *conn)
+{
+    return conn->compact.buf != NULL && conn->local_port <= RDP_COMPACT_MAX_PORT &&
+           conn->remote_port <= RDP_COMPACT_MAX_PORT;
+}
+
+static void rdp_local_syn_options(struct rdp_connection_s *conn, struct rdp_syn_options_s *opts)
+{
+    opts->outstanding = RDP_MAX_OUTSTANGING;
+    opts->maxsegsize = conn->mss;
+    opts->flags = (conn->sdm ? RDP_SYN_FLAG_SDM : 0) | RDP_SYN_FLAG_WINDOW;
+    opts->fec = conn->fec.buf != NULL ? conn->fec.group : 0;
+    opts->session = conn->session.local;
+    if (conn->session.local != 0)
+        opts->flags |= RDP_SYN_FLAG_SESSION;
+    if (conn->channels.local)
+        opts->flags |= RDP_SYN_FLAG_CHANNELS;
+    if (rdp_compact_usable(conn))
+        opts->flags |= RDP_SYN_FLAG_COMPACT;
+    if (conn->msg_in.buf != NULL)
+        opts->flags |= RDP_SYN_FLAG_MESSAGES;
+}
+
+static void rdp_apply_syn_options(struct rdp_connection_s *conn, const struct rdp_syn_options_s *opts)
+{
+    int i;
+    // Remote side which doesn't advertise segment size uses default one
+    conn->snd.mss = opts->maxsegsize > 0 ? opts->maxsegsize : RDP_MAX_SEGMENT_SIZE;
+    if (conn->snd.mss > conn->mss)
+        conn->snd.mss = conn->mss;
+
+    // Remote side with max outstanding = 0 accepts only one segment at time
+    conn->snd.max = opts->outstanding;
+    if (conn->snd.max > RDP_MAX_OUTSTANGING)
+        conn->snd.max = RDP_MAX_OUTSTANGING;
+    if (conn->snd.max < 1)
+        conn->snd.max = 1;
+
+    conn->flow.enabled = (opts->flags & RDP_SYN_FLAG_WINDOW) != 0;
+    conn->unordered = !conn->sdm && !(opts->flags & RDP_SYN_FLAG_SDM);
+
+    // FEC is used when both sides support it
+    conn->fec.remote_group = 0;
+    if (conn->fec.buf != NULL && opts->fec >= 2 && opts->fec <= RDP_FEC_MAX_GROUP_SIZE)
+        conn->fec.remote_group = opts->fec;
+    memset(&conn->fec.snd, 0, sizeof(conn->fec.snd));
+    memset(&conn->fec.rcv, 0, sizeof(conn->fec.rcv));
+    conn->fec.rcv.start = conn->rcv.irs + 1;
+    conn->snd.wnd = RDP_MAX_OUTSTANGING;
+
+    // Sessions are used when both sides have identifiers
+    conn->session.remote = 0;
+    if (conn->session.local != 0 && (opts->flags & RDP_SYN_FLAG_SESSION))
+        conn->session.remote = opts->session;
+
+    conn->channels.enabled = conn->channels.local && (opts->flags & RDP_SYN_FLAG_CHANNELS);
+    conn->compact.enabled = rdp_compact_usable(conn) && (opts->flags & RDP_SYN_FLAG_COMPACT);
+    conn->msg_out.reassembled = (opts->flags & RDP_SYN_FLAG_MESSAGES) != 0;
+    for (i = 0; i < RDP_MAX_CHANNELS; i++)
+    {
+        conn->channels.ch[i].snd_seq = 0;
+        conn->channels.ch[i].rcv_seq = 0;
+    }
+}
+
+// Start search of path MTU from known working size up to max segment size
+static void rdp_pmtu_start(struct rdp_connection_s *conn)
+{
+    if (conn->pmtu.size == 0 || conn->pmtu.size > conn->snd.mss)
+        conn->pmtu.size = RDP_PMTU_BASE_SIZE < conn->snd.mss ? RDP_PMTU_BASE_SIZE : conn->snd.mss;
+    conn->pmtu.hi = conn->snd.mss;
+    conn->pmtu.probe = 0;
+    conn->wait_pmtu.flag = 0;
+}
+
+static void rdp_pmtu_probe_done(struct rdp_connection_s *conn, bool passed)
+{
+    if (passed)
+        conn->pmtu.size = conn->pmtu.probe;
+    else
+        conn->pmtu.hi = conn->pmtu.probe - 4;
+    conn->pmtu.probe = 0;
+    if (conn->pmtu.hi < conn->pmtu.size + RDP_PMTU_PROBE_STEP)
+    {
+        // Search finished
+        conn->wait_pmtu.time = 0;
+        conn->wait_pmtu.flag = 1;
+    }
+}
+
+// Send padded NUL segment of the size between known working size and upper bound
+static void rdp_pmtu_probe(struct rdp_connection_s *conn)
+{
+    if (!conn->pmtu.enabled || conn->state != RDP_OPEN)
+        return;
+    if (conn->pmtu.probe != 0 || conn->wait_pmtu.flag)
+        return;
+    if (conn->pmtu.hi < conn->pmtu.size + RDP_PMTU_PROBE_STEP)
+        return;
+    if (!rdp_can_send(conn))
+        return;
+    size_t size = (conn->pmtu.size + conn->pmtu.hi) / 2 & ~(size_t)3;
+    conn->pmtu.probe = size;
+    conn->pmtu.seq = conn->snd.nxt;
+    // Receive window and session identifier are added when probe is sent
+    if (conn->flow.enabled)
+        size -= 2;
+    if (conn->session.remote != 0)
+        size -= RDP_SESSION_LEN;
+    size_t len = rdp_build_probe_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur,
+                                         size);
+    rdp_send_segment(conn, len);
+}
+
+// Check if probe in flight was acknowledged
+static void rdp_pmtu_acked(struct rdp_connection_s *conn)
+{
+    if (conn->pmtu.probe == 0)
+        return;
+    struct rdp_segment_s *seg = rdp_segment(conn, conn->pmtu.seq);
+    if (rdp_seq_lt(conn->pmtu.seq, conn->snd.una) || !seg->wait_ack.flag)
+        rdp_pmtu_probe_done(conn, !seg->retransmitted);
+}
+
+// Probe was not acknowledged in time. It is resent without padding,
+// because it occupies sequence number
+static bool rdp_pmtu_lost(struct rdp_connection_s *conn, struct rdp_segment_s *seg)
+{
+    if (!conn->pmtu.enabled)
+        return false;
+    if (conn->pmtu.probe == 0 || seg->seq != conn->pmtu.seq || seg->retransmitted)
+    {
+        // Big segment is lost again, path MTU may have decreased
+        if (seg->retransmitted && seg->len > RDP_PMTU_BASE_SIZE && conn->pmtu.size > RDP_PMTU_BASE_SIZE)
+        {
+            conn->pmtu.size = RDP_PMTU_BASE_SIZE;
+            rdp_pmtu_start(conn);
+        }
+        return false;
+    }
+    struct rdp_header_s *hdr = (struct rdp_header_s *)seg->buf;
+    hdr->data_length = 0;
+    seg->len = hdr->header_length * 2;
+    rdp_pmtu_probe_done(conn, false);
+    return true;
+}
+
+static void rdp_opened(struct rdp_connection_s *conn)
+{
+    conn->state = RDP_OPEN;
+    conn->pacing.tokens = rdp_pacing_burst(conn);
+    if (conn->pmtu.enabled)
+        rdp_pmtu_start(conn);
+    conn->wait_keepalive_send.time = 0;
+    conn->wait_keepalive_send.flag = 1;
+    if (conn->cbs.connected)
+        conn->cbs.connected(conn);
+}
+
+// Sequence number of received segment is in receive window
+static bool rdp_seq_acceptable(struct rdp_connection_s *conn, uint32_t seq)
+{
+    return rdp_seq_lt(conn->rcv.cur, seq) && rdp_seq_le(seq, conn->rcv.cur + 2 * RDP_MAX_OUTSTANGING);
+}
+
 static bool rdp_send_nul(struct rdp_connection_s *conn)
 {
     if (conn->state != RDP_OPEN)
         return false;
-    if (!rdp_can_send(conn))
+    // Segments in flight already check that remote side is alive
+    if (rdp_outstanding(conn) > 0)
         return false;
 
     size_t len = rdp_build_nul_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur);
-    conn->snd.una = conn->snd.nxt;
-    //printf("SEND CLOCK. Set una = %i\n", conn->snd.una);
-    if (conn->cbs.send)
-        conn->cbs.send(conn, conn->outbuf, len);
-    conn->wait_ack.time = 0;
-    conn->wait_ack.flag = 1;
+    rdp_send_segment(conn, len);
     conn->wait_keepalive_send.time = 0;
     return true;
 }
 
-static bool rdp_send_syn(struct rdp_connection_s *conn, uint8_t src_port, uint8_t dst_port)
+static bool rdp_send_syn(struct rdp_connection_s *conn, uint8_t src_port, uint8_t dst_port,
+                         const uint8_t *data, size_t dlen)
 {
     if (conn->state != RDP_CLOSED)
         return false;
+    // Remote max segment size is not known yet
+    size_t hlen = RDP_BASE_HEADER_LEN + RDP_SYN_OPTIONS_LEN + (conn->session.local != 0 ? RDP_SESSION_LEN : 0);
+    if (hlen + dlen > conn->mss)
+        return false;
     conn->local_port = src_port;
     conn->remote_port = dst_port;
     // send SYN
     conn->state = RDP_SYN_SENT;
 
-    conn->snd.nxt = conn->snd.iss + 1;
-    conn->snd.dts = conn->snd.iss;
+    conn->snd.nxt = conn->snd.iss;
+    conn->snd.una = conn->snd.iss;
+    conn->snd.max = 1;
+    conn->snd.mss = conn->mss;
+    rdp_rtt_reset(conn);
+    rdp_cc_reset(conn);
 
-    size_t len = rdp_build_syn_package(conn->outbuf, src_port, dst_port, conn->snd.nxt);
-    conn->snd.una = conn->snd.nxt;
-    conn->snd.nxt++;
-    
-    conn->out_data_length = len;
-    if (conn->cbs.send)
-        conn->cbs.send(conn, conn->outbuf, len);
-    conn->wait_ack.time = 0;
-    conn->wait_ack.flag = 1;
+    struct rdp_syn_options_s opts;
+    rdp_local_syn_options(conn, &opts);
+    size_t len = rdp_build_syn_package(conn->outbuf, src_port, dst_port, conn->snd.nxt, &opts, data, dlen);
+    rdp_send_segment(conn, len);
     return true;
 }
 
 // Receie handlers
-static bool rdp_syn_received(struct rdp_connection_s *conn, uint8_t src_port, uint8_t dst_port, uint32_t seq)
+static bool rdp_syn_received(struct rdp_connection_s *conn, uint8_t src_port, uint8_t dst_port, uint32_t seq,
+                             const struct rdp_syn_options_s *opts, const uint8_t *data, size_t dlen)
 {
     conn->wait_keepalive.time = 0;
     conn->wait_keepalive.flag = 1;
@@ -129,79 +859,101 @@ static bool rdp_syn_received(struct rdp_connection_s *conn, uint8_t src_port, ui
             return false;
         conn->remote_port = src_port;
     }
+    if (conn->state == RDP_SYN_RCVD && seq == conn->rcv.irs)
+    {
+        // SYN is repeated because our SYN,ACK was lost. Its data
+        // is already delivered and response is in SYN,ACK
+        struct rdp_segment_s *seg = rdp_segment(conn, conn->snd.iss);
+        if (seg->wait_ack.flag)
+            rdp_retry(conn, seg);
+        return true;
+    }
     if (conn->state == RDP_SYN_SENT || conn->state == RDP_LISTEN || conn->state == RDP_SYN_RCVD)
     {
         conn->state = RDP_SYN_RCVD;
 
-        conn->rcv.dts = seq;
         conn->rcv.irs = seq;
         conn->rcv.cur = seq;
         conn->rcv.expect = seq + 1;
-        
-        conn->snd.dts = conn->snd.iss;
-        conn->snd.nxt = conn->snd.iss + 1;
-
-        size_t len = rdp_build_synack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur);
-        conn->snd.una = conn->snd.nxt;
-        conn->snd.nxt++;
-        
-        conn->out_data_length = len;
-        if (conn->cbs.send)
-            conn->cbs.send(conn, conn->outbuf, len);
-        conn->wait_ack.time = 0;
-        conn->wait_ack.flag = 1;
+        rdp_flush_received(conn);
+        rdp_ring_clear(&conn->stream.rcv_ring);
+        rdp_apply_syn_options(conn, opts);
+
+        // SYN,ACK replaces our SYN, if any
+        rdp_flush_segments(conn);
+        conn->snd.nxt = conn->snd.iss;
+        conn->snd.una = conn->snd.iss;
+
+        struct rdp_syn_options_s local_opts;
+        rdp_local_syn_options(conn, &local_opts);
+        size_t len = rdp_build_synack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur, &local_opts);
+        if (dlen > 0)
+        {
+            // Data sent by user from data_received is added to SYN,ACK
+            conn->syn_reply = 1;
+            rdp_deliver_data(conn, data, dlen, false);
+            conn->syn_reply = 0;
+            len += ((struct rdp_header_s *)conn->outbuf)->data_length;
+        }
+        rdp_send_segment(conn, len);
         return true;
     }
     return false;
 }
 
-static bool rdp_synack_received(struct rdp_connection_s *conn, uint32_t seq, uint32_t ack)
+// Response to data of SYN is carried in SYN,ACK
+static bool rdp_syn_reply(struct rdp_connection_s *conn, const uint8_t *data, size_t dlen)
 {
+    struct rdp_header_s *hdr = (struct rdp_header_s *)conn->outbuf;
+    size_t hlen = hdr->header_length * 2;
+    if (!conn->syn_reply || hdr->data_length > 0)
+        return false;
+    if (hlen + dlen > conn->snd.mss)
+        return false;
+    memcpy(conn->outbuf + hlen, data, dlen);
+    hdr->data_length = dlen;
+    return true;
+}
+
+static bool rdp_synack_received(struct rdp_connection_s *conn, uint32_t seq, uint32_t ack,
+                                const struct rdp_syn_options_s *opts, const uint8_t *data, size_t dlen)
+{
+    int completed;
     switch (conn->state)
     {
-        case RDP_OPEN:
         case RDP_SYN_SENT:
-            if (conn->snd.una == ack)
-            {
-                conn->snd.una = conn->snd.iss;
-                conn->wait_ack.flag = 0;
-            }
-            else if (conn->snd.una != conn->snd.iss)
-            {
+            if (ack != conn->snd.una)
                 return false;
-            }
+            // Data carried by SYN is acknowledged
+            completed = rdp_segments_acked(conn, ack);
 
+            conn->rcv.irs = seq;
             conn->rcv.cur = seq;
             conn->rcv.expect = seq + 1;
+            rdp_flush_received(conn);
+            rdp_ring_clear(&conn->stream.rcv_ring);
+            rdp_apply_syn_options(conn, opts);
 
-            size_t len = rdp_build_ack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur, NULL, 0);
-
-            conn->out_data_length = len;
-            if (conn->cbs.send)
-                conn->cbs.send(conn, conn->outbuf, len);
-            if (conn->state != RDP_OPEN)
-            {
-                conn->state = RDP_OPEN;
-                conn->wait_keepalive_send.time = 0;
-                conn->wait_keepalive_send.flag = 1;
-                if (conn->cbs.connected)
-                    conn->cbs.connected(conn);
-            }
+            rdp_send_ack(conn);
+            rdp_opened(conn);
+            rdp_send_completed(conn, completed);
+            if (dlen > 0 && conn->state == RDP_OPEN)
+                rdp_deliver_data(conn, data, dlen, false);
+            return true;
+        case RDP_OPEN:
+            // Our ACK was lost and remote side repeats SYN,ACK
+            if (seq != conn->rcv.irs)
+                return false;
+            rdp_send_ack(conn);
             return true;
         case RDP_SYN_RCVD:
-            if (conn->snd.una == ack)
-            {
-                conn->wait_ack.flag = 0;
-                conn->snd.una = conn->snd.iss;
-            }
-            else if (conn->snd.una != conn->snd.iss)
-            {
+            if (ack != conn->snd.una)
                 return false;
-            }
-            conn->state = RDP_OPEN;
-            conn->rcv.cur = seq;
-            if (conn->cbs.connected)
-                conn->cbs.connected(conn);
+            completed = rdp_segments_acked(conn, ack);
+            rdp_opened(conn);
+            rdp_send_completed(conn, completed);
+            if (dlen > 0 && conn->state == RDP_OPEN)
+                rdp_deliver_data(conn, data, dlen, false);
             return true;
         default:
             return false;
@@ -212,7 +964,7 @@ static bool rdp_synack_received(struct rdp_connection_s *conn, uint32_t seq, uin
 static bool rdp_rst_received(struct rdp_connection_s *conn, uint32_t seq)
 {
     size_t len;
-    if (conn->rcv.expect != seq && conn->rcv.cur != seq)
+    if (!rdp_seq_acceptable(conn, seq) && conn->rcv.cur != seq)
     {
         return false;
     }
@@ -220,17 +972,18 @@ static bool rdp_rst_received(struct rdp_connection_s *conn, uint32_t seq)
     switch(conn->state)
     {
         case RDP_OPEN:
+            if (conn->rcv.cur == seq)
+                return false;
             conn->rcv.cur = seq;
             conn->rcv.expect = seq + 1;
             conn->state = RDP_PASSIVE_CLOSE_WAIT;
+            // Not acknowledged data is dropped
+            rdp_flush_segments(conn);
             len = rdp_build_rstack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur);
-            conn->snd.una = conn->snd.nxt;
-            conn->snd.nxt++;
-            conn->out_data_length = len;
-            if (conn->cbs.send)
-                conn->cbs.send(conn, conn->outbuf, len);
-            conn->wait_ack.time = 0;
-            conn->wait_ack.flag = 1;
+            rdp_send_segment(conn, len);
+            // Repeated RST is answered by record of closed connection
+            if (conn->recent.enabled)
+                return rdp_final_close(conn);
             conn->wait_close.time = 0;
             conn->wait_close.flag = 1;
             conn->wait_keepalive_send.flag = 0;
@@ -241,77 +994,61 @@ static bool rdp_rst_received(struct rdp_connection_s *conn, uint32_t seq)
         case RDP_PASSIVE_CLOSE_WAIT:
             conn->rcv.cur = seq;
             conn->rcv.expect = seq + 1;
-            conn->wait_ack.flag = 0;
+            rdp_flush_segments(conn);
             len = rdp_build_rstack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur);
-            conn->snd.una = conn->snd.nxt;
-            conn->snd.nxt++;
-            conn->out_data_length = len;
-            if (conn->cbs.send)
-                conn->cbs.send(conn, conn->outbuf, len);
+            rdp_send_package(conn, len);
             return rdp_final_close(conn);
+        default:
+            return false;
     }
     return false;
 }
 
 static bool rdp_rstack_received(struct rdp_connection_s *conn, uint32_t seq, uint32_t ack)
 {
-    if (conn->rcv.expect != seq && conn->rcv.cur != seq)
+    if (!rdp_seq_acceptable(conn, seq))
     {
         return false;
     }
-    if (conn->snd.una == ack)
-    {
-        conn->wait_ack.flag = 0;
-        conn->snd.una = conn->snd.iss;
-    }
-    else if (conn->snd.una != conn->snd.iss)
+    if (conn->state != RDP_ACTIVE_CLOSE_WAIT || ack != conn->snd.una)
     {
         return false;
     }
+    rdp_segments_acked(conn, ack);
     conn->rcv.cur = seq;
     conn->rcv.expect = seq + 1;
-    if (conn->state == RDP_ACTIVE_CLOSE_WAIT)
-    {
-        size_t len = rdp_build_ack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur, NULL, 0);
-        conn->out_data_length = len;
-        if (conn->cbs.send)
-            conn->cbs.send(conn, conn->outbuf, len);
-        return rdp_final_close(conn);
-    }
-    return false;
+    rdp_send_ack(conn);
+    return rdp_final_close(conn);
 }
 
 static bool rdp_nul_received(struct rdp_connection_s *conn, uint32_t seq)
 {
     if (conn->state == RDP_OPEN)
     {
-        if (conn->rcv.expect != seq && conn->rcv.cur != seq)
+        if (seq == conn->rcv.cur + 1)
         {
-            return false;
+            rdp_rcv_in_order(conn, seq, 0);
         }
-        conn->rcv.cur = seq;
-        conn->rcv.expect = seq;
-        size_t len = rdp_build_ack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur, NULL, 0);
-        
-        conn->out_data_length = len;
-        if (conn->cbs.send)
-            conn->cbs.send(conn, conn->outbuf, len);
+        else if (rdp_seq_lt(conn->rcv.cur, seq))
+        {
+            if (!rdp_rcv_out_of_order(conn, seq, NULL, 0, false))
+                return false;
+        }
+        rdp_send_ack(conn);
+        rdp_deliver_buffered(conn, seq + 1);
         return true;
     }
     return false;
 }
 
-static bool rdp_empty_ack_received(struct rdp_connection_s *conn, uint32_t seq, uint32_t ack)
+static bool rdp_empty_ack_received(struct rdp_connection_s *conn)
 {
-    conn->rcv.expect = seq;
     switch(conn->state)
     {
         case RDP_SYN_RCVD:
-            conn->state = RDP_OPEN;
-            conn->wait_keepalive_send.time = 0;
-            conn->wait_keepalive_send.flag = 1;
-            if (conn->cbs.connected)
-                conn->cbs.connected(conn);
+            if (rdp_outstanding(conn) > 0)
+                return false;
+            rdp_opened(conn);
             return true;
         case RDP_OPEN:
             return true;
@@ -322,22 +1059,58 @@ static bool rdp_empty_ack_received(struct rdp_connection_s *conn, uint32_t seq,
     }
 }
 
-static bool rdp_ack_data_received(struct rdp_connection_s *conn, uint32_t seq, uint32_t ack, const uint8_t *data, size_t dlen, bool *rcvd)
+// Out of order data can be delivered at once. Messages and
+// stream need order, paused receiver holds data
+static bool rdp_deliver_unordered(struct rdp_connection_s *conn)
+{
+    return conn->unordered && !conn->flow.paused &&
+           conn->msg_in.buf == NULL && !conn->stream.enabled;
+}
+
+static bool rdp_ack_data_received(struct rdp_connection_s *conn, uint32_t seq, const uint8_t *data, size_t dlen, bool more, bool *rcvd)
 {
-    conn->rcv.expect = seq + 1;
     switch (conn->state)
     {
-        case RDP_OPEN:
-            if (seq > conn->rcv.dts)
+        case RDP_SYN_RCVD:
+            // ACK for SYN,ACK was lost, but data came
+            if (rdp_outstanding(conn) > 0)
+                return false;
+            rdp_opened(conn);
+            // fall through
+        case RDP_OPEN: {
+            bool res = true;
+            if (seq == conn->rcv.cur + 1 && !conn->flow.paused)
             {
+                // No space to store data, remote side will resend it
+                if (!rdp_rcv_space(conn, dlen))
+                    return false;
                 memcpy(conn->recvbuf, data, dlen);
+                rdp_rcv_in_order(conn, seq, dlen);
                 *rcvd = true;
+                // Segment filled a gap, acknowledge immediately
+                if (conn->rcv.cur != seq)
+                    rdp_send_ack(conn);
+                else
+                    rdp_send_delayed_ack(conn);
+                return res;
             }
-            size_t len = rdp_build_ack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur, NULL, 0);
-            conn->out_data_length = len;
-            if (conn->cbs.send)
-                conn->cbs.send(conn, conn->outbuf, len);
-            return true;
+            else if (rdp_seq_lt(conn->rcv.cur, seq))
+            {
+                // Out of order segment
+                struct rdp_rcv_segment_s *rseg = rdp_rcv_segment(conn, seq);
+                bool dup = rseg->flag && rseg->seq == seq;
+                res = rdp_rcv_out_of_order(conn, seq, data, dlen, more);
+                if (res && !dup && (rdp_deliver_unordered(conn) || rdp_channel_next(conn, data, dlen)))
+                {
+                    // Delivered now, only sequence number is kept
+                    memcpy(conn->recvbuf, data, dlen);
+                    rseg->len = 0;
+                    *rcvd = true;
+                }
+            }
+            rdp_send_ack(conn);
+            return res;
+        }
         case RDP_PASSIVE_CLOSE_WAIT:
             return rdp_final_close(conn);
         default:
@@ -345,112 +1118,438 @@ static bool rdp_ack_data_received(struct rdp_connection_s *conn, uint32_t seq, u
     }
 }
 
-static bool rdp_ack_received(struct rdp_connection_s *conn, const uint8_t *inbuf)
+// Add received sequenced segment to parity of its group
+static void rdp_fec_received(struct rdp_connection_s *conn, const uint8_t *inbuf)
 {
-    struct rdp_header_s *hdr = (struct rdp_header_s *)inbuf;
-    
+    if (conn->fec.buf == NULL || conn->fec.remote_group == 0)
+        return;
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)inbuf;
+    // ACK without data doesn't occupy sequence number
+    if (!hdr->nul && hdr->data_length == 0)
+        return;
     uint32_t seq = hdr->sequence_number;
-    uint32_t ack = hdr->acknowledgement_number;
+    if (rdp_seq_le(seq, conn->rcv.cur))
+        return;
+    uint32_t group = conn->fec.remote_group;
+    uint32_t start = seq - (seq - conn->rcv.irs - 1) % group;
+    if (rdp_seq_lt(start, conn->fec.rcv.start))
+        return;
+    if (rdp_seq_lt(conn->fec.rcv.start, start))
+    {
+        memset(&conn->fec.rcv, 0, sizeof(conn->fec.rcv));
+        conn->fec.rcv.start = start;
+    }
+    uint32_t bit = 1u << (seq - start);
+    if (conn->fec.rcv.mask & bit)
+        return;
+    conn->fec.rcv.mask |= bit;
+    if (hdr->nul)
+    {
+        // NUL which replaced segment with data
+        if (hdr->more)
+            conn->fec.rcv.invalid = 1;
+        return;
+    }
+    uint8_t *pbuf = conn->fec.buf + conn->mss + sizeof(struct rdp_header_s);
+    const uint8_t *data = inbuf + hdr->header_length * 2;
+    size_t i;
+    if (hdr->data_length > conn->fec.rcv.len)
+    {
+        memset(pbuf + conn->fec.rcv.len, 0, hdr->data_length - conn->fec.rcv.len);
+        conn->fec.rcv.len = hdr->data_length;
+    }
+    for (i = 0; i < hdr->data_length; i++)
+        pbuf[i] ^= data[i];
+    conn->fec.rcv.parity.len_xor ^= hdr->data_length;
+    conn->fec.rcv.parity.tag_xor ^= 1 | (hdr->more << 1);
+}
 
-    //printf("ACK received. seq = %i, ack = %i, expect = %i, cur = %i, dts = %i, una = %i\n", seq, ack, conn->rcv.expect, conn->rcv.cur, conn->snd.dts, conn->snd.una);
+// Parity of group received. If only one segment of group is missing,
+// it is rebuilt and received as if it came from remote side
+static bool rdp_parity_received(struct rdp_connection_s *conn, const uint8_t *inbuf)
+{
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)inbuf;
+    struct rdp_parity_s parity;
+    if (conn->fec.buf == NULL || conn->fec.remote_group == 0)
+        return false;
+    if (!rdp_parity_info(inbuf, &parity))
+        return false;
+    conn->fec.stats.parity_received++;
+    uint32_t group = conn->fec.remote_group;
+    if (parity.group != group || hdr->sequence_number != conn->fec.rcv.start || conn->fec.rcv.invalid)
+        return true;
 
-    if (conn->rcv.expect != seq && conn->rcv.cur != seq)
+    uint32_t i, missing = group;
+    int nmissing = 0;
+    for (i = 0; i < group; i++)
     {
-        return false;
+        if (!(conn->fec.rcv.mask & (1u << i)))
+        {
+            missing = i;
+            nmissing++;
+        }
     }
-    if (conn->snd.una == conn->snd.iss)
+    uint32_t seq = conn->fec.rcv.start + missing;
+    if (nmissing != 1 || rdp_seq_le(seq, conn->rcv.cur))
+        return true;
+
+    size_t maxlen = conn->mss - sizeof(struct rdp_header_s);
+    if (hdr->data_length > maxlen)
+        return true;
+    uint8_t *pkg = conn->fec.buf + conn->mss;
+    uint8_t *pbuf = pkg + sizeof(struct rdp_header_s);
+    const uint8_t *data = inbuf + hdr->header_length * 2;
+    if (hdr->data_length > conn->fec.rcv.len)
     {
-        // ok
+        memset(pbuf + conn->fec.rcv.len, 0, hdr->data_length - conn->fec.rcv.len);
+        conn->fec.rcv.len = hdr->data_length;
     }
-    else if (ack == conn->snd.una)
+    for (i = 0; i < hdr->data_length; i++)
+        pbuf[i] ^= data[i];
+    size_t dlen = parity.len_xor ^ conn->fec.rcv.parity.len_xor;
+    uint8_t tag = parity.tag_xor ^ conn->fec.rcv.parity.tag_xor;
+    if (dlen > maxlen)
+        return true;
+
+    // Segment is not added to parity again
+    conn->fec.rcv.mask |= 1u << missing;
+    size_t len;
+    if (tag & 1)
     {
-        conn->wait_ack.flag = 0;
-        conn->snd.una = conn->snd.iss;
+        len = rdp_build_ack_package(pkg, conn->remote_port, conn->local_port, seq, conn->snd.una - 1, NULL, 0);
+        struct rdp_header_s *rhdr = (struct rdp_header_s *)pkg;
+        rhdr->data_length = dlen;
+        rhdr->more = (tag >> 1) & 1;
+        len += dlen;
     }
-    else if (ack < conn->snd.una)
+    else
     {
-        // ok
+        len = rdp_build_nul_package(pkg, conn->remote_port, conn->local_port, seq, conn->snd.una - 1);
     }
-    else
+    conn->fec.stats.recovered++;
+    return rdp_received(conn, pkg, len);
+}
+
+// Remember receive window advertised by remote side. Returns true if
+// the window is changed
+static bool rdp_window_received(struct rdp_connection_s *conn, const uint8_t *inbuf)
+{
+    uint16_t window;
+    if (!conn->flow.enabled || !rdp_package_window(inbuf, &window) || conn->snd.wnd == window)
+        return false;
+    conn->snd.wnd = window;
+    return true;
+}
+
+static bool rdp_ack_received(struct rdp_connection_s *conn, const uint8_t *inbuf)
+{
+    struct rdp_header_s *hdr = (struct rdp_header_s *)inbuf;
+    bool wnd_update = rdp_window_received(conn, inbuf);
+    
+    uint32_t seq = hdr->sequence_number;
+    uint32_t ack = hdr->acknowledgement_number;
+
+    //printf("ACK received. seq = %i, ack = %i, cur = %i, una = %i, nxt = %i\n", seq, ack, conn->rcv.cur, conn->snd.una, conn->snd.nxt);
+
+    // Acknowledgement of segment which was not sent
+    if (!rdp_seq_lt(ack, conn->snd.nxt))
     {
         return false;
     }
-    
-    conn->rcv.cur = seq;
-    
+
+    uint32_t una = conn->snd.una;
+    int completed = rdp_segments_acked(conn, ack);
     size_t pdlen = hdr->data_length;
+    if (conn->snd.una != una)
+        conn->snd.dupacks = 0;
+    // Window update is not a duplicate acknowledgement
+    else if (pdlen == 0 && !wnd_update && rdp_outstanding(conn) > 0 && ack + 1 == una)
+        conn->snd.dupacks++;
+
+    if (hdr->eack)
+    {
+        // Segments received by remote side out of order are not retransmitted
+        uint32_t acks[RDP_MAX_OUTSTANGING];
+        size_t nacks = rdp_eack_list(inbuf, acks, RDP_MAX_OUTSTANGING);
+        const struct rdp_segment_s *last = NULL;
+        int nacked = 0;
+        size_t i;
+        for (i = 0; i < nacks; i++)
+        {
+            if (rdp_seq_le(acks[i], ack) || !rdp_seq_lt(acks[i], conn->snd.nxt))
+                continue;
+            // Slot of segment from delayed EACK can hold newer segment
+            struct rdp_segment_s *seg = rdp_segment(conn, acks[i]);
+            if (!seg->wait_ack.flag || seg->seq != acks[i])
+                continue;
+            if (last == NULL || rdp_seq_lt(last->seq, seg->seq))
+                last = seg;
+            seg->wait_ack.flag = 0;
+            nacked++;
+        }
+        if (last != NULL)
+            rdp_cc_acked(conn, nacked, rdp_rtt_sample(conn, last));
+    }
+
+    rdp_pmtu_acked(conn);
+
+    if (conn->state == RDP_OPEN)
+        rdp_fast_retransmit(conn);
+
+    rdp_send_pending(conn);
+
     bool res = false;
     bool rcvd = false;
     if (pdlen > 0)
     {
         const uint8_t *data = inbuf + hdr->header_length * 2;
-        res = rdp_ack_data_received(conn, seq, ack, data, pdlen, &rcvd);
+        res = rdp_ack_data_received(conn, seq, data, pdlen, hdr->more, &rcvd);
     }
     else
     {
-        res = rdp_empty_ack_received(conn, seq, ack);
+        res = rdp_empty_ack_received(conn);
+    }
+
+    rdp_send_completed(conn, completed);
+    
+    if (rcvd)
+    {
+        rdp_deliver(conn, conn->recvbuf, pdlen, hdr->more);
+        rdp_deliver_buffered(conn, seq + 1);
+        rdp_deliver_channels(conn);
     }
 
-    if (conn->snd.dts != conn->snd.iss && ack == conn->snd.dts)
-    {
-        //printf("COMPLETED\n");
-        conn->snd.dts = conn->snd.iss;
-        if (conn->cbs.data_send_completed)
-            conn->cbs.data_send_completed(conn);
-    }
-    else
-    {
-        //printf("seq = %i, ack = %i, dts = %i\n", seq, ack, conn->snd.dts);
-    }
-    
-    if (rcvd)
-    {
-        conn->rcv.dts = seq;
-        if (conn->cbs.data_received)
-            conn->cbs.data_received(conn, conn->recvbuf, pdlen);
-    }
-    return res;
+    if (conn->wait_linger.flag && rdp_all_sent(conn))
+        rdp_send_rst(conn);
+
+    // Nothing was sent by callbacks to carry the acknowledgement
+    if (conn->state == RDP_OPEN && conn->delayed_ack.pending > 0 &&
+        conn->delayed_ack.pending >= conn->delayed_ack.segments)
+    {
+        rdp_send_ack(conn);
+    }
+    return res;
+}
+
+// Initialization
+
+// Segment size mss must be longer than any header and multiple of 4.
+// Returns false if it is not
+bool rdp_init_connection(struct rdp_connection_s *conn, uint8_t *outbuf, uint8_t *recvbuf,
+                         uint8_t *winbuf, size_t mss)
+{
+    int i;
+    if (mss <= RDP_MAX_HEADER_LEN || mss % 4 != 0)
+        return false;
+    memset(conn, 0, sizeof(*conn));
+    rdp_reset_connection(conn);
+    if (mss > RDP_SEGMENT_SIZE_LIMIT)
+        mss = RDP_SEGMENT_SIZE_LIMIT;
+    conn->mss = mss;
+    conn->snd.mss = mss;
+    conn->outbuf = outbuf;
+    conn->recvbuf = recvbuf;
+    for (i = 0; i < RDP_MAX_OUTSTANGING; i++)
+    {
+        conn->sndq[i].buf = winbuf + i * mss;
+        conn->rcvq[i].data = winbuf + (RDP_MAX_OUTSTANGING + i) * mss;
+    }
+    conn->sdm = RDP_SDM;
+    conn->fec.group = RDP_FEC_GROUP_SIZE;
+    conn->linger.timeout = RDP_LINGER_TIMEOUT;
+    rdp_set_delayed_ack(conn, RDP_DELAYED_ACK_SEGMENTS, RDP_DELAYED_ACK_TIMEOUT);
+    return true;
+}
+
+void rdp_set_send_cb(struct rdp_connection_s *conn, void (*send)(struct rdp_connection_s *, const uint8_t *, size_t))
+{
+    conn->cbs.send = send;
+}
+
+void rdp_set_connected_cb(struct rdp_connection_s *conn, void (*connected)(struct rdp_connection_s *))
+{
+    conn->cbs.connected = connected;
+}
+
+void rdp_set_closed_cb(struct rdp_connection_s *conn, void (*closed)(struct rdp_connection_s *))
+{
+    conn->cbs.closed = closed;
+}
+
+void rdp_set_data_send_completed_cb(struct rdp_connection_s *conn, void (*data_send_completed)(struct rdp_connection_s *))
+{
+    conn->cbs.data_send_completed = data_send_completed;
+}
+
+void rdp_set_data_received_cb(struct rdp_connection_s *conn, void (*data_received)(struct rdp_connection_s *, const uint8_t *, size_t))
+{
+    conn->cbs.data_received = data_received;
+}
+
+void rdp_set_data_dropped_cb(struct rdp_connection_s *conn, void (*data_dropped)(struct rdp_connection_s *, const uint8_t *, size_t))
+{
+    conn->cbs.data_dropped = data_dropped;
+}
+
+void rdp_set_send_queue_level_cb(struct rdp_connection_s *conn, void (*send_queue_level)(struct rdp_connection_s *, bool))
+{
+    conn->cbs.send_queue_level = send_queue_level;
+}
+
+void rdp_set_channel_received_cb(struct rdp_connection_s *conn,
+                                 void (*channel_received)(struct rdp_connection_s *, uint8_t, const uint8_t *, size_t))
+{
+    conn->cbs.channel_received = channel_received;
+}
+
+void rdp_set_user_argument(struct rdp_connection_s *conn, void *user_arg)
+{
+    conn->user_arg = user_arg;
+}
+
+void rdp_set_congestion_control(struct rdp_connection_s *conn, const struct rdp_cc_s *cc)
+{
+    conn->cc.ops = cc;
+    rdp_cc_reset(conn);
+}
+
+void rdp_set_delayed_ack(struct rdp_connection_s *conn, int segments, int timeout)
+{
+    conn->delayed_ack.segments = segments > 0 ? segments : 1;
+    conn->delayed_ack.timeout = timeout;
+}
+
+// Enable queue of segments for rdp_send. send_queue_level callback
+// is called when amount of queued bytes reaches high
+void rdp_set_send_queue(struct rdp_connection_s *conn, uint8_t *buf, size_t size, size_t high)
+{
+    rdp_ring_init(&conn->send_queue.ring, buf, size);
+    conn->send_queue.high = high > 0 ? high : size;
+    conn->send_queue.above = 0;
+}
+
+// Coalesce small writes issued while data is in flight into one segment.
+// buf has size of mss, NULL disables coalescing. Coalesced data is sent
+// not later than max_delay after the first write
+void rdp_set_coalescing(struct rdp_connection_s *conn, uint8_t *buf, int max_delay)
+{
+    rdp_flush(conn);
+    conn->coalesce.buf = buf;
+    conn->coalesce.len = 0;
+    conn->coalesce.max_delay = max_delay > 0 ? max_delay : RDP_COALESCE_MAX_DELAY;
+    conn->wait_coalesce.flag = 0;
+}
+
+// Make rdp_close wait until sent and queued data is acknowledged,
+// at most timeout, or RDP_LINGER_TIMEOUT if timeout is 0
+void rdp_set_linger(struct rdp_connection_s *conn, bool enabled, int timeout)
+{
+    conn->linger.enabled = enabled;
+    conn->linger.timeout = timeout > 0 ? timeout : RDP_LINGER_TIMEOUT;
+}
+
+// Identifier of this side exchanged at handshake, 0 disables sessions.
+// Packages sent by remote side carry it, so when remote address changes,
+// transport finds connection with rdp_package_session() and keeps it
+void rdp_set_session_id(struct rdp_connection_s *conn, uint32_t id)
+{
+    conn->session.local = id;
+}
+
+// Configure logical channel. Channels are used when both sides configure
+// them. buf of size bytes holds segments of channel which wait for window,
+// channel 0 uses send queue of connection. Messages and stream data are
+// carried by channel 0, other channels keep their own order with them
+bool rdp_set_channel(struct rdp_connection_s *conn, uint8_t channel, int priority, uint8_t *buf, size_t size)
+{
+    if (channel >= RDP_MAX_CHANNELS)
+        return false;
+    struct rdp_channel_s *ch = &conn->channels.ch[channel];
+    ch->priority = priority;
+    if (channel != 0)
+        rdp_ring_init(&ch->queue, buf, size);
+    conn->channels.local = 1;
+    return true;
 }
 
-// Initialization
+// Use compact header after handshake when remote side supports it.
+// buf of mss bytes holds received packages restored to full form.
+// Compact header is not used if any port of connection is above
+// RDP_COMPACT_MAX_PORT, since only 4 bits of each port are sent
+void rdp_set_compact_header(struct rdp_connection_s *conn, uint8_t *buf)
+{
+    conn->compact.buf = buf;
+}
 
-void rdp_init_connection(struct rdp_connection_s *conn, uint8_t *outbuf, uint8_t *recvbuf)
+// Close connection without waiting in CLOSE-WAIT. Stray RST and RST,ACK
+// of closed connection are answered from compact record, so connection
+// can listen or connect again at once
+void rdp_set_fast_recycle(struct rdp_connection_s *conn, bool enabled)
 {
-    memset(conn, 0, sizeof(*conn));
-    rdp_reset_connection(conn);
-    conn->outbuf = outbuf;
-    conn->recvbuf = recvbuf;
-    conn->snd.iss = 1;
+    conn->recent.enabled = enabled;
+    if (!enabled)
+        conn->wait_recent.flag = 0;
 }
 
-void rdp_set_send_cb(struct rdp_connection_s *conn, void (*send)(struct rdp_connection_s *, const uint8_t *, size_t))
+// Spread sent segments at rate bytes per second, or at rate estimated
+// from window and round trip time if rate is 0. Segments which don't
+// fit the rate are sent from queue, stream or message by rdp_clock
+void rdp_set_pacing(struct rdp_connection_s *conn, bool enabled, int rate)
 {
-    conn->cbs.send = send;
+    conn->pacing.enabled = enabled;
+    conn->pacing.rate = rate;
+    conn->pacing.tokens = rdp_pacing_burst(conn);
 }
 
-void rdp_set_connected_cb(struct rdp_connection_s *conn, void (*connected)(struct rdp_connection_s *))
+// Enable FEC with buffer of RDP_FEC_BUFFER_SIZE(mss). One parity segment
+// is sent per group data segments. Used for next connection, when both sides enable it
+void rdp_set_fec(struct rdp_connection_s *conn, uint8_t *buf, int group)
 {
-    conn->cbs.connected = connected;
+    if (group <= 0)
+        group = RDP_FEC_GROUP_SIZE;
+    if (group < 2)
+        group = 2;
+    if (group > RDP_FEC_MAX_GROUP_SIZE)
+        group = RDP_FEC_MAX_GROUP_SIZE;
+    conn->fec.buf = buf;
+    conn->fec.group = group;
 }
 
-void rdp_set_closed_cb(struct rdp_connection_s *conn, void (*closed)(struct rdp_connection_s *))
+// Request sequenced or unordered delivery. Used for next connection,
+// unordered delivery is negotiated when both sides request it
+void rdp_set_sequenced_delivery(struct rdp_connection_s *conn, bool sdm)
 {
-    conn->cbs.closed = closed;
+    conn->sdm = sdm;
 }
 
-void rdp_set_data_send_completed_cb(struct rdp_connection_s *conn, void (*data_send_completed)(struct rdp_connection_s *))
+// Buffer for reassembly of fragmented messages. It is advertised at
+// handshake, remote side doesn't fragment messages if it is not set
+void rdp_set_message_buffer(struct rdp_connection_s *conn, uint8_t *buf, size_t size)
 {
-    conn->cbs.data_send_completed = data_send_completed;
+    conn->msg_in.buf = buf;
+    conn->msg_in.size = size;
+    conn->msg_in.len = 0;
+    conn->msg_in.overflow = 0;
 }
 
-void rdp_set_data_received_cb(struct rdp_connection_s *conn, void (*data_received)(struct rdp_connection_s *, const uint8_t *, size_t))
+// Enable byte stream mode. Received data is not passed to
+// data_received callback, but stored until rdp_read
+void rdp_set_stream_buffers(struct rdp_connection_s *conn, uint8_t *sndbuf, size_t sndsize,
+                            uint8_t *rcvbuf, size_t rcvsize)
 {
-    conn->cbs.data_received = data_received;
+    conn->stream.enabled = sndbuf != NULL && rcvbuf != NULL;
+    rdp_ring_init(&conn->stream.snd_ring, sndbuf, sndsize);
+    rdp_ring_init(&conn->stream.rcv_ring, rcvbuf, rcvsize);
 }
 
-void rdp_set_user_argument(struct rdp_connection_s *conn, void *user_arg)
+void rdp_set_pmtu_probing(struct rdp_connection_s *conn, bool enabled)
 {
-    conn->user_arg = user_arg;
+    conn->pmtu.enabled = enabled;
+    conn->pmtu.size = 0;
+    conn->pmtu.probe = 0;
+    conn->wait_pmtu.flag = 0;
+    if (enabled && conn->state == RDP_OPEN)
+        rdp_pmtu_start(conn);
 }
 
 // Connection operations
@@ -460,9 +1559,30 @@ void rdp_reset_connection(struct rdp_connection_s *conn)
 {
     memset(&conn->snd, 0, sizeof(conn->snd));
     memset(&conn->rcv, 0, sizeof(conn->rcv));
-    conn->wait_ack.flag = 0;
+    conn->snd.iss = RDP_RANDOM_ISS();
+    conn->snd.mss = conn->mss;
+    rdp_flush_segments(conn);
+    rdp_flush_received(conn);
+    rdp_rtt_reset(conn);
+    rdp_cc_reset(conn);
+    conn->delayed_ack.pending = 0;
+    conn->wait_delayed_ack.flag = 0;
+    conn->unordered = 0;
+    conn->session.remote = 0;
+    conn->channels.enabled = 0;
+    conn->compact.enabled = 0;
+    conn->msg_out.reassembled = 0;
+    conn->fec.remote_group = 0;
+    memset(&conn->fec.stats, 0, sizeof(conn->fec.stats));
+    conn->flow.enabled = 0;
+    conn->flow.paused = 0;
+    conn->flow.adv = 0;
+    conn->pmtu.size = 0;
+    conn->pmtu.probe = 0;
+    conn->wait_pmtu.flag = 0;
     conn->wait_close.flag = 0;
     conn->wait_keepalive.flag = 0;
+    conn->wait_recent.flag = 0;
     conn->wait_keepalive_send.flag = 0;
     conn->state = RDP_CLOSED;
 }
@@ -471,9 +1591,10 @@ bool rdp_listen(struct rdp_connection_s *conn, uint8_t port)
 {
     if (conn->state != RDP_CLOSED)
         return false;
-    conn->snd.dts = conn->snd.iss;
-    conn->snd.nxt = conn->snd.iss + 1;
+    conn->snd.nxt = conn->snd.iss;
     conn->snd.una = conn->snd.iss;
+    rdp_rtt_reset(conn);
+    rdp_cc_reset(conn);
     conn->local_port = port;
     conn->state = RDP_LISTEN;
     return true;
@@ -483,28 +1604,52 @@ bool rdp_connect(struct rdp_connection_s *conn, uint8_t src_port, uint8_t dst_po
 {
     conn->wait_keepalive.time = 0;
     conn->wait_keepalive.flag = 1;
-    return rdp_send_syn(conn, src_port, dst_port);
+    return rdp_send_syn(conn, src_port, dst_port, NULL, 0);
+}
+
+// Connect with data carried in SYN. Remote side delivers it as
+// soon as SYN is accepted and may carry response in SYN,ACK.
+// SYN must fit max segment size of both sides
+bool rdp_connect_data(struct rdp_connection_s *conn, uint8_t src_port, uint8_t dst_port,
+                      const uint8_t *data, size_t dlen)
+{
+    conn->wait_keepalive.time = 0;
+    conn->wait_keepalive.flag = 1;
+    return rdp_send_syn(conn, src_port, dst_port, data, dlen);
+}
+
+// Start RST exchange. Not acknowledged data is dropped
+static void rdp_send_rst(struct rdp_connection_s *conn)
+{
+    conn->state = RDP_ACTIVE_CLOSE_WAIT;
+    rdp_flush_segments(conn);
+    size_t len = rdb_build_rst_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur);
+    rdp_send_segment(conn, len);
+    conn->wait_close.time = 0;
+    conn->wait_close.flag = 1;
+    conn->wait_keepalive.flag = 0;
+    conn->wait_keepalive_send.flag = 0;
 }
 
+// With graceful close RST is sent when all data is acknowledged.
+// Closing during graceful close drops data at once
 bool rdp_close(struct rdp_connection_s *conn)
 {
     //printf("*** closing. state=%i\n", conn->state);
     switch (conn->state)
     {
     case RDP_OPEN: {
-        conn->state = RDP_ACTIVE_CLOSE_WAIT;
-        size_t len = rdb_build_rst_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur);
-        conn->snd.una = conn->snd.nxt;
-        conn->snd.nxt++;
-        conn->out_data_length = len;
-        if (conn->cbs.send)
-            conn->cbs.send(conn, conn->outbuf, len);
-        conn->wait_ack.time = 0;
-        conn->wait_ack.flag = 1;
-        conn->wait_close.time = 0;
-        conn->wait_close.flag = 1;
-        conn->wait_keepalive.flag = 0;
-        conn->wait_keepalive_send.flag = 0;
+        if (conn->linger.enabled && !conn->wait_linger.flag)
+        {
+            rdp_send_coalesced(conn, true);
+            if (!rdp_all_sent(conn))
+            {
+                conn->wait_linger.time = 0;
+                conn->wait_linger.flag = 1;
+                return true;
+            }
+        }
+        rdp_send_rst(conn);
         return true;
     }
     case RDP_LISTEN: {
@@ -524,46 +1669,437 @@ static bool rdp_final_close(struct rdp_connection_s *conn)
     if (conn->state != RDP_ACTIVE_CLOSE_WAIT &&
         conn->state != RDP_PASSIVE_CLOSE_WAIT)
         return false;
+    if (conn->recent.enabled)
+    {
+        conn->recent.local_port = conn->local_port;
+        conn->recent.remote_port = conn->remote_port;
+        conn->recent.nxt = conn->snd.nxt;
+        conn->recent.cur = conn->rcv.cur;
+        conn->wait_recent.time = 0;
+        conn->wait_recent.flag = 1;
+    }
+    rdp_flush_segments(conn);
+    rdp_flush_received(conn);
+    conn->delayed_ack.pending = 0;
+    conn->wait_delayed_ack.flag = 0;
+    conn->pmtu.size = 0;
+    conn->pmtu.probe = 0;
+    conn->wait_pmtu.flag = 0;
     conn->wait_keepalive.flag = 0;
-    conn->wait_ack.flag = 0;
     conn->wait_close.flag = 0;
     conn->wait_keepalive_send.flag = 0;
+    // Segments of the next connection are not confused with old ones
+    conn->snd.iss = RDP_RANDOM_ISS();
     conn->state = RDP_CLOSED;
     if (conn->cbs.closed)
         conn->cbs.closed(conn);
     return true;
 }
 
-bool rdp_send(struct rdp_connection_s *conn, const uint8_t *data, size_t dlen)
+// Send fragments of message while window allows
+static void rdp_send_fragments(struct rdp_connection_s *conn)
 {
-    if (conn->state != RDP_OPEN)
+    while (conn->msg_out.data != NULL && conn->state == RDP_OPEN && rdp_can_send(conn))
+    {
+        size_t dlen = conn->msg_out.len - conn->msg_out.sent;
+        if (dlen > rdp_max_data_size(conn))
+            dlen = rdp_max_data_size(conn);
+        size_t len = rdp_build_ack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur,
+                                           conn->msg_out.data + conn->msg_out.sent, dlen);
+        if (len == 0)
+            return;
+        conn->msg_out.sent += dlen;
+        struct rdp_header_s *hdr = (struct rdp_header_s *)conn->outbuf;
+        hdr->more = conn->msg_out.sent < conn->msg_out.len;
+        if (!hdr->more)
+            conn->msg_out.data = NULL;
+        rdp_send_segment(conn, len);
+        conn->wait_keepalive_send.time = 0;
+    }
+}
+
+// Send data written to stream while window allows
+static void rdp_send_stream(struct rdp_connection_s *conn)
+{
+    while (conn->stream.snd_ring.len > 0 && conn->state == RDP_OPEN && rdp_can_send(conn))
+    {
+        size_t hlen = rdp_build_ack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur, NULL, 0);
+        size_t dlen = rdp_ring_read(&conn->stream.snd_ring, conn->outbuf + hlen, rdp_max_data_size(conn));
+        struct rdp_header_s *hdr = (struct rdp_header_s *)conn->outbuf;
+        hdr->data_length = dlen;
+        rdp_send_segment(conn, hlen + dlen);
+        conn->wait_keepalive_send.time = 0;
+    }
+}
+
+// Put segment data to queue as 16 bit length followed by data
+static bool rdp_ring_put_segment(struct rdp_ring_s *ring, const uint8_t *data, size_t dlen)
+{
+    uint16_t len = dlen;
+    if (rdp_ring_free(ring) < sizeof(len) + dlen)
         return false;
-    if (!rdp_can_send(conn))
+    rdp_ring_write(ring, (const uint8_t *)&len, sizeof(len));
+    rdp_ring_write(ring, data, dlen);
+    return true;
+}
+
+// Send segments from queue while window allows
+static void rdp_send_ring(struct rdp_connection_s *conn, struct rdp_ring_s *ring)
+{
+    while (ring->len > 0 && conn->state == RDP_OPEN && rdp_can_send(conn))
+    {
+        uint16_t dlen;
+        rdp_ring_read(ring, (uint8_t *)&dlen, sizeof(dlen));
+        size_t hlen = rdp_build_ack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur, NULL, 0);
+        rdp_ring_read(ring, conn->outbuf + hlen, dlen);
+        struct rdp_header_s *hdr = (struct rdp_header_s *)conn->outbuf;
+        hdr->data_length = dlen;
+        rdp_send_segment(conn, hlen + dlen);
+        conn->wait_keepalive_send.time = 0;
+    }
+}
+
+// Put segment to send queue, if it is enabled and has space
+static bool rdp_enqueue(struct rdp_connection_s *conn, const uint8_t *data, size_t dlen)
+{
+    struct rdp_ring_s *ring = &conn->send_queue.ring;
+    if (!rdp_ring_put_segment(ring, data, dlen))
+        return false;
+    if (!conn->send_queue.above && ring->len >= conn->send_queue.high)
+    {
+        conn->send_queue.above = 1;
+        if (conn->cbs.send_queue_level)
+            conn->cbs.send_queue_level(conn, true);
+    }
+    return true;
+}
+
+// Send segments from send queue while window allows
+static void rdp_send_queued(struct rdp_connection_s *conn)
+{
+    struct rdp_ring_s *ring = &conn->send_queue.ring;
+    if (ring->len == 0)
+        return;
+    rdp_send_ring(conn, ring);
+    if (ring->len == 0 && conn->send_queue.above)
+    {
+        conn->send_queue.above = 0;
+        if (conn->cbs.send_queue_level)
+            conn->cbs.send_queue_level(conn, false);
+    }
+}
+
+// Send coalesced small writes when nothing is in flight, the segment
+// is full, max delay passed or force is set
+static void rdp_send_coalesced(struct rdp_connection_s *conn, bool force)
+{
+    if (conn->coalesce.len == 0 || conn->state != RDP_OPEN || !rdp_can_send(conn))
+        return;
+    bool expired = conn->wait_coalesce.flag && conn->wait_coalesce.time >= conn->coalesce.max_delay;
+    if (!force && !expired && rdp_outstanding(conn) > 0 && conn->coalesce.len < rdp_max_data_size(conn))
+        return;
+    size_t len = rdp_build_ack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur,
+                                       conn->coalesce.buf, conn->coalesce.len);
+    if (len == 0)
+        return;
+    conn->coalesce.len = 0;
+    conn->wait_coalesce.flag = 0;
+    rdp_send_segment(conn, len);
+    conn->wait_keepalive_send.time = 0;
+}
+
+// Put small write to coalescing buffer. Returns false if coalescing
+// is disabled or the data doesn't fit
+static bool rdp_coalesce(struct rdp_connection_s *conn, const uint8_t *data, size_t dlen)
+{
+    if (conn->coalesce.buf == NULL || conn->msg_out.data != NULL || conn->send_queue.ring.len > 0)
+        return false;
+    size_t max = rdp_max_data_size(conn);
+    if (conn->coalesce.len + dlen > max)
+        rdp_send_coalesced(conn, true);
+    if (conn->coalesce.len + dlen > max)
+        return false;
+    memcpy(conn->coalesce.buf + conn->coalesce.len, data, dlen);
+    if (conn->coalesce.len == 0)
+    {
+        conn->wait_coalesce.time = 0;
+        conn->wait_coalesce.flag = 1;
+    }
+    conn->coalesce.len += dlen;
+    rdp_send_coalesced(conn, false);
+    return true;
+}
+
+// Send pending data of channel 0
+static void rdp_send_pending_default(struct rdp_connection_s *conn)
+{
+    rdp_send_fragments(conn);
+    if (conn->msg_out.data != NULL)
+        return;
+    // Queued segments were written after coalesced ones
+    rdp_send_coalesced(conn, conn->send_queue.ring.len > 0);
+    if (conn->coalesce.len > 0 && conn->send_queue.ring.len > 0)
+        return;
+    rdp_send_queued(conn);
+    if (conn->send_queue.ring.len == 0)
+        rdp_send_stream(conn);
+}
+
+// Send queued data. Message being sent goes first, then coalesced
+// small writes, then segments queued by rdp_send, then stream data.
+// With channels, pending data of higher priority channels goes first
+static void rdp_send_pending(struct rdp_connection_s *conn)
+{
+    bool served[RDP_MAX_CHANNELS] = {0};
+    int n;
+    if (!conn->channels.enabled)
+    {
+        rdp_send_pending_default(conn);
+        return;
+    }
+    for (n = 0; n < RDP_MAX_CHANNELS; n++)
     {
+        int i, best = -1;
+        for (i = 0; i < RDP_MAX_CHANNELS; i++)
+        {
+            if (!served[i] && (best < 0 || conn->channels.ch[i].priority > conn->channels.ch[best].priority))
+                best = i;
+        }
+        served[best] = 1;
+        if (best == 0)
+        {
+            rdp_send_pending_default(conn);
+            continue;
+        }
+        conn->channels.cur = best;
+        rdp_send_ring(conn, &conn->channels.ch[best].queue);
+        conn->channels.cur = 0;
+    }
+}
+
+bool rdp_send(struct rdp_connection_s *conn, const uint8_t *data, size_t dlen)
+{
+    if (conn->state == RDP_SYN_RCVD)
+        return rdp_syn_reply(conn, data, dlen);
+    if (conn->state != RDP_OPEN || conn->wait_linger.flag)
+        return false;
+    if (dlen > rdp_max_data_size(conn))
         return false;
+    if (rdp_coalesce(conn, data, dlen))
+        return true;
+    // Segment must not get between fragments of message
+    // or before already queued or coalesced segments
+    if (conn->msg_out.data != NULL || conn->send_queue.ring.len > 0 || conn->coalesce.len > 0 || !rdp_can_send(conn))
+    {
+        return rdp_enqueue(conn, data, dlen);
     }
     // Actual data sending
     size_t len = rdp_build_ack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur, data, dlen);
-    conn->snd.una = conn->snd.nxt;
-    conn->snd.dts = conn->snd.nxt;
-    conn->snd.nxt++;
-    conn->out_data_length = len;
+    if (len == 0)
+        return false;
+    rdp_send_segment(conn, len);
+    conn->wait_keepalive_send.time = 0;
+    return true;
+}
+
+// Send segment in channel. Segments which don't fit window wait
+// in queue of channel. Channel 0 is the same as rdp_send
+bool rdp_send_channel(struct rdp_connection_s *conn, uint8_t channel, const uint8_t *data, size_t dlen)
+{
+    if (channel == 0)
+        return rdp_send(conn, data, dlen);
+    if (conn->state != RDP_OPEN || conn->wait_linger.flag || !conn->channels.enabled || channel >= RDP_MAX_CHANNELS)
+        return false;
+    if (dlen == 0 || dlen > rdp_max_data_size(conn))
+        return false;
+    struct rdp_ring_s *ring = &conn->channels.ch[channel].queue;
+    if (ring->len > 0 || !rdp_can_send(conn))
+        return rdp_ring_put_segment(ring, data, dlen);
+    size_t len = rdp_build_ack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur, data, dlen);
+    if (len == 0)
+        return false;
+    conn->channels.cur = channel;
+    rdp_send_segment(conn, len);
+    conn->channels.cur = 0;
+    conn->wait_keepalive_send.time = 0;
+    return true;
+}
+
+// Send coalesced small writes now
+bool rdp_flush(struct rdp_connection_s *conn)
+{
+    rdp_send_coalesced(conn, true);
+    return conn->coalesce.len == 0;
+}
+
+// Send segment which is not resent after ttl. The segment is
+// not queued, so it fails if window is closed
+bool rdp_send_ttl(struct rdp_connection_s *conn, const uint8_t *data, size_t dlen, int ttl)
+{
+    if (conn->state != RDP_OPEN || conn->wait_linger.flag)
+        return false;
+    if (dlen > rdp_max_data_size(conn))
+        return false;
+    rdp_send_coalesced(conn, true);
+    if (conn->msg_out.data != NULL || conn->send_queue.ring.len > 0 || conn->coalesce.len > 0 || !rdp_can_send(conn))
+        return false;
+    size_t len = rdp_build_ack_package(conn->outbuf, conn->local_port, conn->remote_port, conn->snd.nxt, conn->rcv.cur, data, dlen);
+    if (len == 0)
+        return false;
+    struct rdp_segment_s *seg = rdp_segment(conn, conn->snd.nxt);
+    rdp_send_segment(conn, len);
+    seg->ttl = ttl;
+    conn->wait_keepalive_send.time = 0;
+    return true;
+}
+
+// Send message of any length. It is split into segments and delivered
+// to remote side at once. data must be kept until data_send_completed.
+// Message longer than one segment needs message buffer on remote side,
+// set by rdp_set_message_buffer before connection is opened
+bool rdp_send_message(struct rdp_connection_s *conn, const uint8_t *data, size_t len)
+{
+    if (conn->state != RDP_OPEN || conn->wait_linger.flag)
+        return false;
+    if (len > rdp_max_data_size(conn) && !conn->msg_out.reassembled)
+        return false;
+    rdp_send_coalesced(conn, true);
+    if (conn->msg_out.data != NULL || conn->send_queue.ring.len > 0 || conn->coalesce.len > 0 || len == 0)
+        return false;
+    if (!rdp_can_send(conn))
+        return false;
+    conn->msg_out.data = data;
+    conn->msg_out.len = len;
+    conn->msg_out.sent = 0;
+    rdp_send_pending(conn);
+    return true;
+}
+
+// Deliver buffered segments which were held by paused delivery or
+// didn't fit receive ring, and tell remote side about opened window
+static void rdp_rcv_resume(struct rdp_connection_s *conn)
+{
+    if (conn->state != RDP_OPEN)
+        return;
+    uint32_t seq = conn->rcv.cur + 1;
+    struct rdp_rcv_segment_s *rseg = rdp_rcv_segment(conn, seq);
+    if (rseg->flag && rseg->seq == seq && !conn->flow.paused && rdp_rcv_space(conn, rseg->len))
+    {
+        rdp_rcv_in_order(conn, seq, rseg->len);
+        rdp_deliver_buffered(conn, seq);
+        rdp_send_ack(conn);
+    }
+    else if (conn->flow.enabled && conn->flow.adv == 0 && rdp_rcv_window(conn) > 0)
+    {
+        rdp_send_ack(conn);
+    }
+}
+
+// Stop delivery of received data. Remote side stops sending
+// when delivery is paused
+void rdp_pause_delivery(struct rdp_connection_s *conn)
+{
+    conn->flow.paused = 1;
+}
+
+void rdp_resume_delivery(struct rdp_connection_s *conn)
+{
+    conn->flow.paused = 0;
+    rdp_rcv_resume(conn);
+}
+
+// Copy data to stream send ring. Returns amount of accepted bytes
+size_t rdp_write(struct rdp_connection_s *conn, const uint8_t *data, size_t len)
+{
+    if (conn->state != RDP_OPEN || !conn->stream.enabled || conn->wait_linger.flag)
+        return 0;
+    len = rdp_ring_write(&conn->stream.snd_ring, data, len);
+    rdp_send_pending(conn);
+    return len;
+}
+
+// Take received data from stream receive ring. Returns amount of read bytes
+size_t rdp_read(struct rdp_connection_s *conn, uint8_t *data, size_t len)
+{
+    if (!conn->stream.enabled)
+        return 0;
+    len = rdp_ring_read(&conn->stream.rcv_ring, data, len);
+    rdp_rcv_resume(conn);
+    return len;
+}
+
+// Answer RST and RST,ACK repeated by remote side of recently closed
+// connection: its RST,ACK or our final ACK was lost
+static bool rdp_recent_received(struct rdp_connection_s *conn, const uint8_t *inbuf)
+{
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)inbuf;
+    size_t len;
+    if (!conn->wait_recent.flag)
+        return false;
+    if (hdr->source_port != conn->recent.remote_port || hdr->destination_port != conn->recent.local_port)
+        return false;
+    enum rdp_package_type_e type = rdp_package_type(inbuf);
+    if (type == RDP_SYN)
+    {
+        // Remote side starts new connection
+        conn->wait_recent.flag = 0;
+        return false;
+    }
+    // Port pair is used by new connection
+    if (conn->state != RDP_CLOSED && conn->state != RDP_LISTEN &&
+        conn->local_port == conn->recent.local_port && conn->remote_port == conn->recent.remote_port)
+    {
+        conn->wait_recent.flag = 0;
+        return false;
+    }
+    switch (type)
+    {
+        case RDP_RST:
+            if (hdr->sequence_number != conn->recent.cur)
+                return false;
+            len = rdp_build_rstack_package(conn->outbuf, conn->recent.local_port, conn->recent.remote_port,
+                                           conn->recent.nxt - 1, conn->recent.cur);
+            break;
+        case RDP_RSTACK:
+            if (hdr->sequence_number != conn->recent.cur)
+                return false;
+            len = rdp_build_ack_package(conn->outbuf, conn->recent.local_port, conn->recent.remote_port,
+                                        conn->recent.nxt, conn->recent.cur, NULL, 0);
+            break;
+        default:
+            return false;
+    }
     if (conn->cbs.send)
         conn->cbs.send(conn, conn->outbuf, len);
-    conn->wait_ack.time = 0;
-    conn->wait_ack.flag = 1;
-    conn->wait_keepalive_send.time = 0;
-    //printf("SEND. dts = %i\n", conn->snd.dts);
     return true;
 }
 
 bool rdp_received(struct rdp_connection_s *conn, const uint8_t *inbuf, size_t len)
 {
+    struct rdp_syn_options_s opts;
+    // Compact package is restored to full form, numbers are close to
+    // the ones which remote side sends and acknowledges now
+    if (conn->compact.enabled && len > 0 && rdp_package_compact(inbuf))
+    {
+        len = rdp_compact_decode(inbuf, len, conn->compact.buf, conn->mss, conn->remote_port, conn->local_port,
+                                 conn->rcv.cur, conn->snd.una);
+        if (len == 0)
+            return false;
+        inbuf = conn->compact.buf;
+    }
     if (len < sizeof(struct rdp_header_s))
         return false;
     struct rdp_header_s *hdr = (struct rdp_header_s *)inbuf;
-    if (len < hdr->header_length + hdr->data_length)
+    if (len < hdr->header_length * 2 + hdr->data_length)
+        return false;
+    if (hdr->header_length * 2 + hdr->data_length > conn->mss)
         return false;
+    // Package of another session, e.g. of previous connection on the same ports
+    uint32_t session;
+    if (rdp_package_session(inbuf, len, &session) && session != conn->session.local)
+        return false;
+    if (rdp_recent_received(conn, inbuf))
+        return true;
     rdp_pkg_rcvd(conn);
     enum rdp_package_type_e type = rdp_package_type(inbuf);
     switch (type)
@@ -571,19 +2107,31 @@ bool rdp_received(struct rdp_connection_s *conn, const uint8_t *inbuf, size_t le
         case RDP_SYN:
             if (hdr->destination_port != conn->local_port)
                 return false;
-            return rdp_syn_received(conn, hdr->source_port, hdr->destination_port, hdr->sequence_number);
+            rdp_syn_options(inbuf, &opts);
+            return rdp_syn_received(conn, hdr->source_port, hdr->destination_port, hdr->sequence_number, &opts,
+                                    inbuf + hdr->header_length * 2, hdr->data_length);
         case RDP_ACK:
+        case RDP_EACK:
             if (hdr->source_port != conn->remote_port || hdr->destination_port != conn->local_port)
                 return false;
+            rdp_fec_received(conn, inbuf);
             return rdp_ack_received(conn, inbuf);
         case RDP_SYNACK:
             if (hdr->source_port != conn->remote_port || hdr->destination_port != conn->local_port)
                 return false;
-            return rdp_synack_received(conn, hdr->sequence_number, hdr->acknowledgement_number);
+            rdp_syn_options(inbuf, &opts);
+            return rdp_synack_received(conn, hdr->sequence_number, hdr->acknowledgement_number, &opts,
+                                       inbuf + hdr->header_length * 2, hdr->data_length);
         case RDP_NUL:
             if (hdr->source_port != conn->remote_port || hdr->destination_port != conn->local_port)
                 return false;
+            rdp_window_received(conn, inbuf);
+            rdp_fec_received(conn, inbuf);
             return rdp_nul_received(conn, hdr->sequence_number);
+        case RDP_PARITY:
+            if (hdr->source_port != conn->remote_port || hdr->destination_port != conn->local_port)
+                return false;
+            return rdp_parity_received(conn, inbuf);
         case RDP_RST:
             if (hdr->source_port != conn->remote_port || hdr->destination_port != conn->local_port)
                 return false;
@@ -592,11 +2140,6 @@ bool rdp_received(struct rdp_connection_s *conn, const uint8_t *inbuf, size_t le
             if (hdr->source_port != conn->remote_port || hdr->destination_port != conn->local_port)
                 return false;
             return rdp_rstack_received(conn, hdr->sequence_number, hdr->acknowledgement_number);
-        case RDP_EACK:
-            if (hdr->source_port != conn->remote_port || hdr->destination_port != conn->local_port)
-                return false;
-            // Not supported
-            break;
         default:
             break;
     }
@@ -604,30 +2147,177 @@ bool rdp_received(struct rdp_connection_s *conn, const uint8_t *inbuf, size_t le
     return false;
 }
 
-bool rdp_retry(struct rdp_connection_s *conn)
+static void rdp_retry(struct rdp_connection_s *conn, struct rdp_segment_s *seg)
 {
-    if (conn->cbs.send)
-        conn->cbs.send(conn, conn->outbuf, conn->out_data_length);
-    return true;
+    struct rdp_header_s *hdr = (struct rdp_header_s *)seg->buf;
+    // Acknowledge everything received by now
+    if (hdr->ack)
+    {
+        hdr->acknowledgement_number = conn->rcv.cur;
+        rdp_ack_sent(conn);
+    }
+    seg->retransmitted = 1;
+    memcpy(conn->outbuf, seg->buf, seg->len);
+    rdp_send_package(conn, seg->len);
+}
+
+// Time to live of segment expired. It is replaced by NUL, so remote
+// side skips its sequence number
+static void rdp_segment_expired(struct rdp_connection_s *conn, struct rdp_segment_s *seg)
+{
+    struct rdp_header_s *hdr = (struct rdp_header_s *)seg->buf;
+    size_t hlen = hdr->header_length * 2;
+    if (conn->cbs.data_dropped)
+        conn->cbs.data_dropped(conn, seg->buf + hlen, hdr->data_length);
+    hdr->ack = 0;
+    hdr->nul = 1;
+    // Tells that the segment was replaced
+    hdr->more = 1;
+    hdr->data_length = 0;
+    seg->len = hlen;
+    seg->ttl = 0;
+    seg->wait_ack.time = 0;
+    rdp_retry(conn, seg);
+}
+
+// Retransmit segments which remote side most likely has not received:
+// RDP_DUPACK_THRESHOLD later segments were EACKed, or the oldest one
+// after RDP_DUPACK_THRESHOLD duplicate acknowledgements
+static void rdp_fast_retransmit(struct rdp_connection_s *conn)
+{
+    uint32_t above = 0;
+    bool lost = false;
+    uint32_t seq = conn->snd.nxt;
+    while (seq != conn->snd.una)
+    {
+        seq--;
+        struct rdp_segment_s *seg = rdp_segment(conn, seq);
+        if (!seg->wait_ack.flag)
+        {
+            above++;
+            continue;
+        }
+        if (seg->retransmitted)
+            continue;
+        if (above >= RDP_DUPACK_THRESHOLD ||
+            (seq == conn->snd.una && conn->snd.dupacks >= RDP_DUPACK_THRESHOLD))
+        {
+            seg->wait_ack.time = 0;
+            rdp_retry(conn, seg);
+            lost = true;
+        }
+    }
+    if (lost)
+        rdp_cc_lost(conn, false);
 }
 
 bool rdp_can_send(struct rdp_connection_s *conn)
 {
     if (conn->state != RDP_OPEN)
         return false;
-    //printf("CHECK. una = %i, iss = %i\n", conn->snd.una, conn->snd.iss);
-    return (conn->snd.una == conn->snd.iss);
+    //printf("CHECK. una = %i, nxt = %i, max = %i\n", conn->snd.una, conn->snd.nxt, conn->snd.max);
+    uint32_t wnd = conn->snd.max;
+    if (conn->cc.ops && conn->cc.cwnd < wnd)
+        wnd = conn->cc.cwnd;
+    if (conn->flow.enabled && conn->snd.wnd < wnd)
+        wnd = conn->snd.wnd;
+    // Segments are released by rdp_clock when tokens are accumulated
+    if (conn->pacing.enabled && conn->pacing.tokens <= 0)
+        return false;
+    return rdp_outstanding(conn) < wnd;
+}
+
+// Max data length which can be sent in one segment
+size_t rdp_max_data_size(struct rdp_connection_s *conn)
+{
+    size_t hlen = sizeof(struct rdp_header_s);
+    // Space for advertised window
+    if (conn->flow.enabled)
+        hlen += 2;
+    // Parity segment has longer header
+    if (rdp_fec_sending(conn))
+        hlen += 4;
+    if (conn->session.remote != 0)
+        hlen += RDP_SESSION_LEN;
+    if (conn->channels.enabled)
+        hlen += RDP_CHANNEL_HEADER_LEN;
+    return rdp_segment_size(conn) - hlen;
+}
+
+int rdp_rtt(struct rdp_connection_s *conn)
+{
+    return conn->rtt.srtt;
+}
+
+int rdp_resend_timeout(struct rdp_connection_s *conn)
+{
+    return conn->rtt.rto;
+}
+
+const struct rdp_fec_stats_s *rdp_fec_stats(struct rdp_connection_s *conn)
+{
+    return &conn->fec.stats;
 }
 
 void rdp_clock(struct rdp_connection_s *conn, int dt)
 {
-    if (conn->wait_ack.flag)
+    uint32_t seq;
+    bool retried = false;
+    for (seq = conn->snd.una; seq != conn->snd.nxt; seq++)
     {
-        conn->wait_ack.time += dt;
-        if (conn->wait_ack.time > RDP_RESEND_TIMEOUT)
+        struct rdp_segment_s *seg = rdp_segment(conn, seq);
+        if (!seg->wait_ack.flag)
+            continue;
+        seg->age += dt;
+        if (seg->ttl > 0 && seg->age > seg->ttl)
         {
-            conn->wait_ack.time = 0;
-            rdp_retry(conn);
+            rdp_segment_expired(conn, seg);
+            continue;
+        }
+        seg->wait_ack.time += dt;
+        if (seg->wait_ack.time > conn->rtt.rto)
+        {
+            seg->wait_ack.time = 0;
+            // Lost probe means too big segment, not congestion
+            if (!rdp_pmtu_lost(conn, seg))
+                retried = true;
+            rdp_retry(conn, seg);
+        }
+    }
+    if (retried)
+    {
+        // Exponential backoff until new round trip time measurement
+        conn->rtt.rto *= 2;
+        if (conn->rtt.rto > RDP_MAX_RESEND_TIMEOUT)
+            conn->rtt.rto = RDP_MAX_RESEND_TIMEOUT;
+        rdp_cc_lost(conn, true);
+    }
+    if (conn->wait_pmtu.flag)
+    {
+        conn->wait_pmtu.time += dt;
+        if (conn->wait_pmtu.time > RDP_PMTU_REPROBE_TIMEOUT)
+        {
+            rdp_pmtu_start(conn);
+        }
+    }
+    if (conn->pacing.enabled)
+        rdp_pacing_refill(conn, dt);
+    if (conn->wait_coalesce.flag)
+        conn->wait_coalesce.time += dt;
+    rdp_send_pending(conn);
+    rdp_pmtu_probe(conn);
+    if (conn->wait_linger.flag)
+    {
+        conn->wait_linger.time += dt;
+        if (rdp_all_sent(conn) || conn->wait_linger.time > conn->linger.timeout)
+            rdp_send_rst(conn);
+    }
+    if (conn->wait_delayed_ack.flag)
+    {
+        conn->wait_delayed_ack.time += dt;
+        if (conn->wait_delayed_ack.time > conn->delayed_ack.timeout)
+        {
+            rdp_send_ack(conn);
         }
     }
     if (conn->wait_close.flag)
@@ -641,6 +2331,12 @@ void rdp_clock(struct rdp_connection_s *conn, int dt)
             rdp_final_close(conn);
         }
     }
+    if (conn->wait_recent.flag)
+    {
+        conn->wait_recent.time += dt;
+        if (conn->wait_recent.time > RDP_CLOSE_TIMEOUT)
+            conn->wait_recent.flag = 0;
+    }
     if (conn->wait_keepalive.flag)
     {
         conn->wait_keepalive.time += dt;
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <defs.h>
+#include <congestion.h>
+#include <ring.h>
+#include <packages.h>
 
 enum rdp_state_e {
     RDP_CLOSED = 0,
@@ -14,12 +17,73 @@ enum rdp_state_e {
 
 struct rdp_connection_s;
 
+// Sent segment, kept until acknowledged
+struct rdp_segment_s {
+    // Retransmission timer. flag is set while the segment is not acknowledged
+    struct {
+        int time;
+        bool flag;
+    } wait_ack;
+
+    // Segment was sent more than once, so its acknowledgement
+    // can not be used for round trip time measurement
+    bool retransmitted;
+
+    // Time to live, segment is not resent after it. 0 if segment
+    // is resent until acknowledged
+    int ttl;
+    // Time since segment was sent first
+    int age;
+
+    uint32_t seq;
+    size_t len;
+    uint8_t *buf;
+};
+
+// Segment received out of order, kept until the gap before it is filled
+struct rdp_rcv_segment_s {
+    bool flag;
+    // Segment is a fragment of message and not the last one
+    bool more;
+    uint32_t seq;
+    size_t len;
+    uint8_t *data;
+};
+
+// Logical channel of connection. Channel 0 carries data sent
+// by rdp_send, messages and stream
+struct rdp_channel_s {
+    // Channels with higher priority are sent first
+    int priority;
+    // Segments waiting for window, buf is provided by user.
+    // Channel 0 uses send queue of connection
+    struct rdp_ring_s queue;
+    // Sequence number of the next segment sent in channel
+    uint8_t snd_seq;
+    // Sequence number of the next segment delivered in channel
+    uint8_t rcv_seq;
+};
+
+// Forward error correction counters
+struct rdp_fec_stats_s {
+    uint32_t parity_sent;
+    uint32_t parity_received;
+    // Segments rebuilt from parity
+    uint32_t recovered;
+};
+
 struct rdp_cbs_s {
     void (*send)(struct rdp_connection_s *, const uint8_t *, size_t);
     void (*connected)(struct rdp_connection_s *);
     void (*closed)(struct rdp_connection_s *);
     void (*data_send_completed)(struct rdp_connection_s *);
     void (*data_received)(struct rdp_connection_s *, const uint8_t *, size_t);
+    // Segment was not acknowledged in its time to live and is dropped
+    void (*data_dropped)(struct rdp_connection_s *, const uint8_t *, size_t);
+    // Send queue reached high water mark (true) or was drained (false)
+    void (*send_queue_level)(struct rdp_connection_s *, bool);
+    // Data received in channel, when channels are used
+    void (*channel_received)(struct rdp_connection_s *, uint8_t, const uint8_t *, size_t);
 };
 
 struct rdp_connection_s {
@@ -37,8 +101,20 @@ struct rdp_connection_s {
         // The initial send sequence  number.
         uint32_t iss;
 
-        // The sequence number of the last package with data
-        uint32_t dts;
+        // The maximum number of outstanding (unacknowledged) segments
+        // that can be sent. Negotiated with SYN options
+        uint32_t max;
+
+        // Amount of duplicate acknowledgements of snd.una - 1
+        uint32_t dupacks;
+
+        // Receive window advertised by remote side. Segments after
+        // the acknowledged one which can be sent
+        uint32_t wnd;
+
+        // Max segment size which can be sent. The smallest of
+        // local and remote max segment size
+        size_t mss;
     } snd;
 
     struct {
@@ -48,25 +124,71 @@ struct rdp_connection_s {
         // The initial receive sequence number.
         uint32_t irs;
 
-        // The sequence number of the last received package with data
-        uint32_t dts;
-
         // expected next seq
         uint32_t expect;
     } rcv;
 
+    // Round trip time estimation, microseconds
+    struct {
+        // Smoothed round trip time
+        int srtt;
+        // Round trip time variation
+        int rttvar;
+        // Current resend timeout
+        int rto;
+        // srtt and rttvar are measured
+        bool flag;
+    } rtt;
+
+    // Congestion control
+    struct rdp_cc_state_s cc;
+
     // A timer used to time out the CLOSE-WAIT state.
     uint32_t closewait;
 
+    // Retransmission queue. Segment with sequence number seq
+    // is stored at sndq[seq % RDP_MAX_OUTSTANGING]
+    struct rdp_segment_s sndq[RDP_MAX_OUTSTANGING];
+
+    // Out of order receive buffer. Segment with sequence number seq
+    // is stored at rcvq[seq % RDP_MAX_OUTSTANGING]
+    struct rdp_rcv_segment_s rcvq[RDP_MAX_OUTSTANGING];
+
     struct {
         int time;
         bool flag;
-    } wait_ack;
+    } wait_close;
 
+    // Record of recently closed connection. It answers repeated RST
+    // and RST,ACK of remote side, so connection doesn't wait in
+    // CLOSE-WAIT and can be reused at once
+    struct {
+        bool enabled;
+        uint8_t local_port;
+        uint8_t remote_port;
+        // snd.nxt and rcv.cur when connection was closed
+        uint32_t nxt;
+        uint32_t cur;
+    } recent;
+
+    // Time since connection was closed, record is dropped after RDP_CLOSE_TIMEOUT
     struct {
         int time;
         bool flag;
-    } wait_close;
+    } wait_recent;
+
+    // Graceful close sends queued data and waits for acknowledgements
+    // before RST, at most timeout
+    struct {
+        bool enabled;
+        int timeout;
+    } linger;
+
+    // Close is requested, waiting for sent data to be acknowledged
+    struct {
+        int time;
+        bool flag;
+    } wait_linger;
 
     struct {
         int time;
@@ -78,6 +200,181 @@ struct rdp_connection_s {
         bool flag;
     } wait_keepalive_send;
 
+    // Path MTU probing
+    struct {
+        bool enabled;
+        // Largest segment size known to pass the path
+        size_t size;
+        // Upper bound of search
+        size_t hi;
+        // Size of probe in flight, 0 if no probe sent
+        size_t probe;
+        // Sequence number of probe in flight
+        uint32_t seq;
+    } pmtu;
+
+    // Time to probe path MTU again
+    struct {
+        int time;
+        bool flag;
+    } wait_pmtu;
+
+    // Delayed acknowledgement policy
+    struct {
+        // Acknowledge every n-th in order segment
+        int segments;
+        // Max delay of acknowledgement
+        int timeout;
+        // Amount of received and not acknowledged segments
+        int pending;
+    } delayed_ack;
+
+    struct {
+        int time;
+        bool flag;
+    } wait_delayed_ack;
+
+    // Coalescing of small writes, buf is provided by user and has size of mss
+    struct {
+        uint8_t *buf;
+        size_t len;
+        int max_delay;
+    } coalesce;
+
+    // Time since first byte was put to coalescing buffer
+    struct {
+        int time;
+        bool flag;
+    } wait_coalesce;
+
+    // Send pacing with token bucket
+    struct {
+        bool enabled;
+        // Bytes per second, 0 if rate is estimated from window and round trip time
+        int rate;
+        // Amount of bytes which can be sent, multiplied by 1000000
+        int64_t tokens;
+    } pacing;
+
+    // Forward error correction with XOR parity segments
+    struct {
+        // Buffer of RDP_FEC_BUFFER_SIZE(mss), NULL if FEC is disabled
+        uint8_t *buf;
+        // Group size of this side
+        int group;
+        // Group size of remote side, 0 if remote side doesn't support FEC
+        int remote_group;
+
+        // Parity of group being sent, data is in the first half of buf
+        struct {
+            struct rdp_parity_s parity;
+            size_t len;
+        } snd;
+
+        // Parity of received segments of group, data is in the second
+        // half of buf after space for header
+        struct {
+            struct rdp_parity_s parity;
+            size_t len;
+            uint32_t start;
+            // Received segments of group
+            uint32_t mask;
+            // Segment of group was replaced, parity doesn't match it
+            bool invalid;
+        } rcv;
+
+        struct rdp_fec_stats_s stats;
+    } fec;
+
+    // Sequenced delivery is requested by this side
+    bool sdm;
+
+    // Both sides don't require sequenced delivery, data is delivered
+    // as soon as it arrives
+    bool unordered;
+
+    // Session identifiers. Packages carry identifier of receiver, so
+    // package from new address of remote side can be matched to connection
+    struct {
+        // Identifier of this side, 0 if sessions are not used
+        uint32_t local;
+        // Identifier of remote side, 0 if not negotiated
+        uint32_t remote;
+    } session;
+
+    // Logical channels with own priority and delivery order
+    struct {
+        // Channels are configured by this side
+        bool local;
+        // Both sides use channels
+        bool enabled;
+        // Channel of segment being sent
+        uint8_t cur;
+        struct rdp_channel_s ch[RDP_MAX_CHANNELS];
+    } channels;
+
+    // Compact header for slow links
+    struct {
+        // Buffer of mss bytes where received compact packages are restored,
+        // NULL if this side doesn't use compact header
+        uint8_t *buf;
+        // Both sides use compact header
+        bool enabled;
+    } compact;
+
+    // Data of received SYN is being delivered, so response
+    // sent by user is carried in SYN,ACK
+    bool syn_reply;
+
+    // Receiver flow control
+    struct {
+        // Both sides advertise receive window
+        bool enabled;
+        // Delivery of received data is paused by user
+        bool paused;
+        // Last advertised window
+        uint32_t adv;
+    } flow;
+
+    // Message being sent by fragments. data is provided by user
+    // and must be kept until the message is sent completely
+    struct {
+        const uint8_t *data;
+        size_t len;
+        size_t sent;
+        // Remote side has message buffer, so message can be fragmented
+        bool reassembled;
+    } msg_out;
+
+    // Reassembly of received message, buf is provided by user
+    struct {
+        uint8_t *buf;
+        size_t size;
+        size_t len;
+        // Message doesn't fit buf and is dropped
+        bool overflow;
+    } msg_in;
+
+    // Segments waiting for window, stored in ring as 16 bit length
+    // followed by data
+    struct {
+        struct rdp_ring_s ring;
+        // High water mark, bytes
+        size_t high;
+        // Queue is above high water mark
+        bool above;
+    } send_queue;
+
+    // Byte stream mode. Written data waits in snd_ring until window
+    // allows to send it, received data waits in rcv_ring until read
+    struct {
+        bool enabled;
+        struct rdp_ring_s snd_ring;
+        struct rdp_ring_s rcv_ring;
+    } stream;
+
+    // Max segment size which can be received. Size of outbuf and recvbuf
+    size_t mss;
     uint8_t *outbuf;
     uint8_t *recvbuf;
     size_t recvlen;
@@ -88,7 +385,14 @@ struct rdp_connection_s {
     void *user_arg;
 };
 
-void rdp_init_connection(struct rdp_connection_s *conn, uint8_t *outbuf, uint8_t *recvbuf);
+// Size of window buffer for connection with max segment size mss
+#define RDP_WINDOW_BUFFER_SIZE(mss) (2 * RDP_MAX_OUTSTANGING * (mss))
+
+// Size of FEC buffer for connection with max segment size mss
+#define RDP_FEC_BUFFER_SIZE(mss) (2 * (mss))
+
+bool rdp_init_connection(struct rdp_connection_s *conn, uint8_t *outbuf, uint8_t *recvbuf,
+                         uint8_t *winbuf, size_t mss);
 void rdp_reset_connection(struct rdp_connection_s *conn);
 
 void rdp_set_send_cb(struct rdp_connection_s *conn, void (*send)(struct rdp_connection_s *, const uint8_t *, size_t));
@@ -96,15 +400,51 @@ void rdp_set_connected_cb(struct rdp_connection_s *conn, void (*connected)(struc
 void rdp_set_closed_cb(struct rdp_connection_s *conn, void (*closed)(struct rdp_connection_s *));
 void rdp_set_data_send_completed_cb(struct rdp_connection_s *conn, void (*data_send_completed)(struct rdp_connection_s *));
 void rdp_set_data_received_cb(struct rdp_connection_s *conn, void (*data_received)(struct rdp_connection_s *, const uint8_t *, size_t));
+void rdp_set_data_dropped_cb(struct rdp_connection_s *conn, void (*data_dropped)(struct rdp_connection_s *, const uint8_t *, size_t));
+void rdp_set_send_queue_level_cb(struct rdp_connection_s *conn, void (*send_queue_level)(struct rdp_connection_s *, bool));
+void rdp_set_channel_received_cb(struct rdp_connection_s *conn,
+                                 void (*channel_received)(struct rdp_connection_s *, uint8_t, const uint8_t *, size_t));
 
 void rdp_set_user_argument(struct rdp_connection_s *conn, void *user_arg);
+void rdp_set_congestion_control(struct rdp_connection_s *conn, const struct rdp_cc_s *cc);
+void rdp_set_delayed_ack(struct rdp_connection_s *conn, int segments, int timeout);
+void rdp_set_pmtu_probing(struct rdp_connection_s *conn, bool enabled);
+void rdp_set_sequenced_delivery(struct rdp_connection_s *conn, bool sdm);
+void rdp_set_fec(struct rdp_connection_s *conn, uint8_t *buf, int group);
+void rdp_set_pacing(struct rdp_connection_s *conn, bool enabled, int rate);
+void rdp_set_coalescing(struct rdp_connection_s *conn, uint8_t *buf, int max_delay);
+void rdp_set_linger(struct rdp_connection_s *conn, bool enabled, int timeout);
+void rdp_set_fast_recycle(struct rdp_connection_s *conn, bool enabled);
+void rdp_set_session_id(struct rdp_connection_s *conn, uint32_t id);
+bool rdp_set_channel(struct rdp_connection_s *conn, uint8_t channel, int priority, uint8_t *buf, size_t size);
+void rdp_set_compact_header(struct rdp_connection_s *conn, uint8_t *buf);
+void rdp_set_send_queue(struct rdp_connection_s *conn, uint8_t *buf, size_t size, size_t high);
+void rdp_set_message_buffer(struct rdp_connection_s *conn, uint8_t *buf, size_t size);
+void rdp_set_stream_buffers(struct rdp_connection_s *conn, uint8_t *sndbuf, size_t sndsize,
+                            uint8_t *rcvbuf, size_t rcvsize);
 
 bool rdp_listen(struct rdp_connection_s *conn, uint8_t port);
 bool rdp_connect(struct rdp_connection_s *conn, uint8_t src_port, uint8_t dst_port);
+bool rdp_connect_data(struct rdp_connection_s *conn, uint8_t src_port, uint8_t dst_port,
+                      const uint8_t *data, size_t dlen);
 bool rdp_close(struct rdp_connection_s *conn);
 
 bool rdp_send(struct rdp_connection_s *conn, const uint8_t *data, size_t dlen);
+bool rdp_flush(struct rdp_connection_s *conn);
+bool rdp_send_ttl(struct rdp_connection_s *conn, const uint8_t *data, size_t dlen, int ttl);
+bool rdp_send_message(struct rdp_connection_s *conn, const uint8_t *data, size_t len);
+bool rdp_send_channel(struct rdp_connection_s *conn, uint8_t channel, const uint8_t *data, size_t dlen);
 bool rdp_can_send(struct rdp_connection_s *conn);
+void rdp_pause_delivery(struct rdp_connection_s *conn);
+void rdp_resume_delivery(struct rdp_connection_s *conn);
+size_t rdp_write(struct rdp_connection_s *conn, const uint8_t *data, size_t len);
+size_t rdp_read(struct rdp_connection_s *conn, uint8_t *data, size_t len);
+
+size_t rdp_max_data_size(struct rdp_connection_s *conn);
+
+int rdp_rtt(struct rdp_connection_s *conn);
+int rdp_resend_timeout(struct rdp_connection_s *conn);
+const struct rdp_fec_stats_s *rdp_fec_stats(struct rdp_connection_s *conn);
 
 bool rdp_received(struct rdp_connection_s *conn, const uint8_t *inbuf, size_t len);
 
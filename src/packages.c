@@ -4,13 +4,53 @@
 #include <string.h>
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
-#define RDP_BASE_HEADER_LEN 14
+#define RDP_PARITY_INFO_LEN 4
+
+static size_t rdp_syn_options_len(const struct rdp_syn_options_s *opts)
+{
+    if (opts->flags & RDP_SYN_FLAG_SESSION)
+        return RDP_SYN_OPTIONS_LEN + RDP_SESSION_LEN;
+    return RDP_SYN_OPTIONS_LEN;
+}
+
+// Variable header starts after session identifier, if any
+static size_t rdp_var_offset(const struct rdp_header_s *hdr)
+{
+    if (hdr->ver == RDP_VERSION_SESSION)
+        return RDP_BASE_HEADER_LEN + RDP_SESSION_LEN;
+    return RDP_BASE_HEADER_LEN;
+}
+
+static void rdp_put_syn_options(uint8_t *buf, const struct rdp_syn_options_s *opts)
+{
+    uint16_t *outstanding = (uint16_t *)buf;
+    *outstanding = opts->outstanding;
+
+    uint16_t *maxsegsize = (uint16_t *)(buf + 2);
+    *maxsegsize = opts->maxsegsize;
+
+    uint16_t *flags = (uint16_t *)(buf + 4);
+    *flags = opts->flags;
+
+    uint16_t *fec = (uint16_t *)(buf + 6);
+    *fec = opts->fec;
+
+    if (opts->flags & RDP_SYN_FLAG_SESSION)
+    {
+        // Session identifier is not aligned in package
+        memcpy(buf + 8, &opts->session, sizeof(opts->session));
+    }
+}
 
 size_t rdp_build_syn_package(uint8_t *buf, uint8_t src, uint8_t dst,
-                             uint32_t initial_seq)
+                             uint32_t initial_seq,
+                             const struct rdp_syn_options_s *opts,
+                             const uint8_t *data, size_t dlen)
 {
     const size_t var = RDP_BASE_HEADER_LEN;
-    const size_t hlen = var + 6;
+    const size_t hlen = var + rdp_syn_options_len(opts);
+    if (hlen + dlen > RDP_SEGMENT_SIZE_LIMIT)
+        return 0;
     struct rdp_header_s *hdr = (struct rdp_header_s *)buf;
     memset(hdr, 0, sizeof(*hdr));
     hdr->syn = 1;
@@ -22,26 +62,21 @@ size_t rdp_build_syn_package(uint8_t *buf, uint8_t src, uint8_t dst,
     hdr->header_length = hlen / 2;
     hdr->source_port = src;
     hdr->destination_port = dst;
-    hdr->data_length = 0;
+    hdr->data_length = dlen;
     hdr->sequence_number = initial_seq;
     hdr->acknowledgement_number = 0;
-    
-    uint16_t *outstanding = (uint16_t *)(buf + var);
-    *outstanding = RDP_MAX_OUTSTANGING;
-
-    uint16_t *maxsegsize = (uint16_t *)(buf + var + 2);
-    *maxsegsize = RDP_MAX_SEGMENT_SIZE;
-
-    uint16_t *flags = (uint16_t *)(buf + var + 4);
-    *flags = RDP_SDM;
-    return hlen;
+    rdp_put_syn_options(buf + var, opts);
+    if (dlen > 0)
+        memcpy(buf + hlen, data, dlen);
+    return hlen + dlen;
 }
 
 size_t rdp_build_synack_package(uint8_t *buf, uint8_t src, uint8_t dst,
-                                uint32_t initial_seq, uint32_t rcv_seq)
+                                uint32_t initial_seq, uint32_t rcv_seq,
+                                const struct rdp_syn_options_s *opts)
 {
     const size_t var = RDP_BASE_HEADER_LEN;
-    const size_t hlen = var + 6;
+    const size_t hlen = var + rdp_syn_options_len(opts);
     struct rdp_header_s *hdr = (struct rdp_header_s *)buf;
     memset(hdr, 0, sizeof(*hdr));
     hdr->syn = 1;
@@ -56,15 +91,7 @@ size_t rdp_build_synack_package(uint8_t *buf, uint8_t src, uint8_t dst,
     hdr->data_length = 0;
     hdr->sequence_number = initial_seq;
     hdr->acknowledgement_number = rcv_seq;
-    
-    uint16_t *outstanding = (uint16_t *)(buf + var);
-    *outstanding = RDP_MAX_OUTSTANGING;
-
-    uint16_t *maxsegsize = (uint16_t *)(buf + var + 2);
-    *maxsegsize = RDP_MAX_SEGMENT_SIZE;
-
-    uint16_t *flags = (uint16_t *)(buf + var + 4);
-    *flags = RDP_SDM;
+    rdp_put_syn_options(buf + var, opts);
     return hlen;
 }
 
@@ -74,7 +101,7 @@ size_t rdp_build_ack_package(uint8_t *buf, uint8_t src, uint8_t dst,
 {
     const size_t var = RDP_BASE_HEADER_LEN;
     const size_t hlen = var;
-    if (hlen + dlen > RDP_MAX_SEGMENT_SIZE)
+    if (hlen + dlen > RDP_SEGMENT_SIZE_LIMIT)
         return 0;
 
     struct rdp_header_s *hdr = (struct rdp_header_s *)buf;
@@ -131,7 +158,7 @@ size_t rdb_build_eack_package(uint8_t *buf, uint8_t src, uint8_t dst,
     nacks = min(nacks, RDP_MAX_OUTSTANGING);
     const size_t var = RDP_BASE_HEADER_LEN;
     const size_t hlen = var + nacks * 4;
-    if (hlen + dlen > RDP_MAX_SEGMENT_SIZE)
+    if (hlen + dlen > RDP_SEGMENT_SIZE_LIMIT)
         return 0;
 
     struct rdp_header_s *hdr = (struct rdp_header_s *)buf;
@@ -150,12 +177,8 @@ size_t rdb_build_eack_package(uint8_t *buf, uint8_t src, uint8_t dst,
     hdr->sequence_number = cur_seq;
     hdr->acknowledgement_number = rcv_seq;
 
-    int i;
-    uint32_t *backs = (uint32_t *)(buf + var);
-    for (i = 0; i < nacks; i++)
-    {
-        backs[i] = acks[i];
-    }
+    // Items of list are not aligned in package
+    memcpy(buf + var, acks, nacks * sizeof(uint32_t));
 
     if (dlen > 0)
         memcpy(buf + hlen, data, dlen);
@@ -206,9 +229,29 @@ size_t rdp_build_nul_package(uint8_t *buf, uint8_t src, uint8_t dst,
     return hlen;
 }
 
+// NUL package padded with zeros to size
+size_t rdp_build_probe_package(uint8_t *buf, uint8_t src, uint8_t dst,
+                               uint32_t cur_seq, uint32_t ack, size_t size)
+{
+    size_t hlen = rdp_build_nul_package(buf, src, dst, cur_seq, ack);
+    if (size <= hlen || size > RDP_SEGMENT_SIZE_LIMIT)
+        return hlen;
+    struct rdp_header_s *hdr = (struct rdp_header_s *)buf;
+    hdr->data_length = size - hlen;
+    memset(buf + hlen, 0, size - hlen);
+    return size;
+}
+
+// Compact package carries only low 4 bits of ports
 void rdb_package_source_destination(const uint8_t *buf, uint8_t *src, uint8_t *dst)
 {
     const struct rdp_header_s *hdr = (const struct rdp_header_s *)buf;
+    if (hdr->ver == RDP_VERSION_COMPACT)
+    {
+        *src = buf[1] >> 4;
+        *dst = buf[1] & 0x0F;
+        return;
+    }
     *src = hdr->source_port;
     *dst = hdr->destination_port;
 }
@@ -242,3 +285,233 @@ enum rdp_package_type_e rdp_package_type(const uint8_t *buf)
     }
     return RDP_INVALID;
 }
+
+void rdp_syn_options(const uint8_t *buf, struct rdp_syn_options_s *opts)
+{
+    const size_t var = RDP_BASE_HEADER_LEN;
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)buf;
+    memset(opts, 0, sizeof(*opts));
+    if (hdr->header_length * 2 < var + 6)
+        return;
+    opts->outstanding = *(const uint16_t *)(buf + var);
+    opts->maxsegsize = *(const uint16_t *)(buf + var + 2);
+    opts->flags = *(const uint16_t *)(buf + var + 4);
+    // Options added later
+    if (hdr->header_length * 2 < var + 8)
+        return;
+    opts->fec = *(const uint16_t *)(buf + var + 6);
+    if (!(opts->flags & RDP_SYN_FLAG_SESSION) || hdr->header_length * 2 < var + 12)
+        return;
+    memcpy(&opts->session, buf + var + 8, sizeof(opts->session));
+}
+
+size_t rdp_eack_list(const uint8_t *buf, uint32_t *acks, size_t maxacks)
+{
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)buf;
+    const size_t var = rdp_var_offset(hdr);
+    if (!hdr->eack || hdr->header_length * 2 < var)
+        return 0;
+    size_t nacks = min((hdr->header_length * 2 - var) / 4, maxacks);
+    memcpy(acks, buf + var, nacks * sizeof(uint32_t));
+    return nacks;
+}
+
+// Insert receive window in the end of variable header of package.
+// EACK list consists of 4 byte items, so the window is found by
+// variable header length
+size_t rdp_add_window(uint8_t *buf, size_t len, uint16_t window)
+{
+    struct rdp_header_s *hdr = (struct rdp_header_s *)buf;
+    size_t hlen = hdr->header_length * 2;
+    if (hdr->syn || len + 2 > RDP_SEGMENT_SIZE_LIMIT)
+        return len;
+    memmove(buf + hlen + 2, buf + hlen, len - hlen);
+    *(uint16_t *)(buf + hlen) = window;
+    hdr->header_length++;
+    return len + 2;
+}
+
+bool rdp_package_window(const uint8_t *buf, uint16_t *window)
+{
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)buf;
+    const size_t var = rdp_var_offset(hdr);
+    size_t hlen = hdr->header_length * 2;
+    if (hdr->syn || hlen < var + 2 || (hlen - var) % 4 != 2)
+        return false;
+    *window = *(const uint16_t *)(buf + hlen - 2);
+    return true;
+}
+
+// Insert session identifier of receiver after base header of package
+size_t rdp_add_session(uint8_t *buf, size_t len, uint32_t session)
+{
+    const size_t var = RDP_BASE_HEADER_LEN;
+    struct rdp_header_s *hdr = (struct rdp_header_s *)buf;
+    if (hdr->syn || len + RDP_SESSION_LEN > RDP_SEGMENT_SIZE_LIMIT)
+        return len;
+    memmove(buf + var + RDP_SESSION_LEN, buf + var, len - var);
+    memcpy(buf + var, &session, sizeof(session));
+    hdr->ver = RDP_VERSION_SESSION;
+    hdr->header_length += RDP_SESSION_LEN / 2;
+    return len + RDP_SESSION_LEN;
+}
+
+// Length of compact header, 0 if package is too short
+static size_t rdp_compact_header_len(const uint8_t *buf, size_t len)
+{
+    if (len < RDP_COMPACT_HEADER_LEN + 1)
+        return 0;
+    if (!(buf[RDP_COMPACT_HEADER_LEN] & 0x80))
+        return RDP_COMPACT_HEADER_LEN + 1;
+    if (len < RDP_COMPACT_HEADER_LEN + 2)
+        return 0;
+    return RDP_COMPACT_HEADER_LEN + 2;
+}
+
+// Number closest to ref which has the same low 8 bits as lsb
+static uint32_t rdp_compact_number(uint8_t lsb, uint32_t ref)
+{
+    return ref + (int8_t)(uint8_t)(lsb - (uint8_t)ref);
+}
+
+bool rdp_package_compact(const uint8_t *buf)
+{
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)buf;
+    return hdr->ver == RDP_VERSION_COMPACT;
+}
+
+// Replace base header of package with compact one. SYN, SYN,ACK, RST and
+// RST,ACK keep full header, so they are understood without connection state
+size_t rdp_compact_encode(uint8_t *buf, size_t len)
+{
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)buf;
+    if (hdr->syn || hdr->rst || hdr->header_length * 2 < RDP_BASE_HEADER_LEN)
+        return len;
+    size_t var = hdr->header_length * 2 - RDP_BASE_HEADER_LEN;
+    size_t dlen = hdr->data_length;
+    if (var / 2 >= RDP_COMPACT_VAR_SESSION || dlen > RDP_COMPACT_DATA_LIMIT ||
+        len < RDP_BASE_HEADER_LEN + var + dlen)
+        return len;
+
+    uint8_t head[RDP_COMPACT_HEADER_LEN + 2];
+    size_t hlen = RDP_COMPACT_HEADER_LEN;
+    head[0] = buf[0];
+    ((struct rdp_header_s *)head)->ver = RDP_VERSION_COMPACT;
+    head[1] = (hdr->source_port & 0x0F) << 4 | (hdr->destination_port & 0x0F);
+    head[2] = hdr->sequence_number & 0xFF;
+    head[3] = hdr->acknowledgement_number & 0xFF;
+    head[4] = var / 2;
+    if (hdr->ver == RDP_VERSION_SESSION)
+        head[4] |= RDP_COMPACT_VAR_SESSION;
+    if (dlen < 0x80)
+    {
+        head[hlen++] = dlen;
+    }
+    else
+    {
+        head[hlen++] = 0x80 | dlen >> 8;
+        head[hlen++] = dlen & 0xFF;
+    }
+
+    memmove(buf + hlen, buf + RDP_BASE_HEADER_LEN, var + dlen);
+    memcpy(buf, head, hlen);
+    return hlen + var + dlen;
+}
+
+// Restore full package from compact one into out. Ports of connection are
+// src and dst, sequence and acknowledgement numbers are the closest ones to
+// seq_ref and ack_ref. Returns 0 if package doesn't belong to connection
+size_t rdp_compact_decode(const uint8_t *buf, size_t len, uint8_t *out, size_t outsize,
+                          uint8_t src, uint8_t dst, uint32_t seq_ref, uint32_t ack_ref)
+{
+    size_t hlen = rdp_compact_header_len(buf, len);
+    if (hlen == 0 || !rdp_package_compact(buf))
+        return 0;
+    if (buf[1] != ((src & 0x0F) << 4 | (dst & 0x0F)))
+        return 0;
+    size_t var = (buf[4] & ~RDP_COMPACT_VAR_SESSION) * 2;
+    size_t dlen = buf[RDP_COMPACT_HEADER_LEN];
+    if (dlen & 0x80)
+        dlen = (dlen & 0x7F) << 8 | buf[RDP_COMPACT_HEADER_LEN + 1];
+    if (len < hlen + var + dlen || RDP_BASE_HEADER_LEN + var + dlen > outsize)
+        return 0;
+
+    struct rdp_header_s *hdr = (struct rdp_header_s *)out;
+    out[0] = buf[0];
+    hdr->ver = (buf[4] & RDP_COMPACT_VAR_SESSION) ? RDP_VERSION_SESSION : RDP_VERSION;
+    hdr->header_length = (RDP_BASE_HEADER_LEN + var) / 2;
+    hdr->source_port = src;
+    hdr->destination_port = dst;
+    hdr->data_length = dlen;
+    hdr->sequence_number = rdp_compact_number(buf[2], seq_ref);
+    hdr->acknowledgement_number = rdp_compact_number(buf[3], ack_ref);
+    memcpy(out + RDP_BASE_HEADER_LEN, buf + hlen, var + dlen);
+    return RDP_BASE_HEADER_LEN + var + dlen;
+}
+
+// Session identifier of received package. Lets to find connection
+// of package which came from new address of remote side
+bool rdp_package_session(const uint8_t *buf, size_t len, uint32_t *session)
+{
+    const size_t var = RDP_BASE_HEADER_LEN;
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)buf;
+    if (len > 0 && hdr->ver == RDP_VERSION_COMPACT)
+    {
+        size_t cvar = rdp_compact_header_len(buf, len);
+        if (cvar == 0 || len < cvar + RDP_SESSION_LEN || !(buf[4] & RDP_COMPACT_VAR_SESSION))
+            return false;
+        memcpy(session, buf + cvar, sizeof(*session));
+        return true;
+    }
+    if (len < var + RDP_SESSION_LEN || hdr->ver != RDP_VERSION_SESSION ||
+        hdr->header_length * 2 < var + RDP_SESSION_LEN)
+        return false;
+    memcpy(session, buf + var, sizeof(*session));
+    return true;
+}
+
+// Parity of FEC group: NUL,ACK package. Sequence number is the first one
+// of group, data is XOR of data of segments in group
+size_t rdp_build_parity_package(uint8_t *buf, uint8_t src, uint8_t dst,
+                                uint32_t first_seq, const struct rdp_parity_s *parity,
+                                const uint8_t *data, size_t dlen)
+{
+    const size_t var = RDP_BASE_HEADER_LEN;
+    const size_t hlen = var + RDP_PARITY_INFO_LEN;
+    if (hlen + dlen > RDP_SEGMENT_SIZE_LIMIT)
+        return 0;
+    struct rdp_header_s *hdr = (struct rdp_header_s *)buf;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->syn = 0;
+    hdr->ack = 1;
+    hdr->eack = 0;
+    hdr->rst = 0;
+    hdr->nul = 1;
+    hdr->ver = RDP_VERSION;
+    hdr->header_length = hlen / 2;
+    hdr->source_port = src;
+    hdr->destination_port = dst;
+    hdr->data_length = dlen;
+    hdr->sequence_number = first_seq;
+    hdr->acknowledgement_number = 0;
+
+    *(uint16_t *)(buf + var) = parity->len_xor;
+    buf[var + 2] = parity->tag_xor;
+    buf[var + 3] = parity->group;
+
+    if (dlen > 0)
+        memcpy(buf + hlen, data, dlen);
+    return hlen + dlen;
+}
+
+bool rdp_parity_info(const uint8_t *buf, struct rdp_parity_s *parity)
+{
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)buf;
+    const size_t var = rdp_var_offset(hdr);
+    if (hdr->header_length * 2 < var + RDP_PARITY_INFO_LEN)
+        return false;
+    parity->len_xor = *(const uint16_t *)(buf + var);
+    parity->tag_xor = buf[var + 2];
+    parity->group = buf[var + 3];
+    return true;
+}
@@ -5,6 +5,10 @@
 #include <unistd.h>
 #include <defs.h>
 
+#define RDP_BASE_HEADER_LEN 14
+#define RDP_SYN_OPTIONS_LEN 8
+#define RDP_SESSION_LEN 4
+
 enum rdp_package_type_e {
     RDP_SYN = 0,
     RDP_ACK,
@@ -24,7 +28,8 @@ struct __attribute__((__packed__)) rdp_header_s {
         uint8_t eack : 1;
         uint8_t rst : 1;
         uint8_t nul : 1;
-        uint8_t _zero : 1;
+        // More fragments of message follow
+        uint8_t more : 1;
         uint8_t ver : 2;
     };
     uint8_t header_length;
@@ -35,11 +40,73 @@ struct __attribute__((__packed__)) rdp_header_s {
     uint32_t acknowledgement_number;
 };
 
+// Flags of SYN options
+// Sequenced delivery mode
+#define RDP_SYN_FLAG_SDM 0x0001
+// Receive window is advertised in the end of variable header
+#define RDP_SYN_FLAG_WINDOW 0x0002
+// Session identifier follows other options
+#define RDP_SYN_FLAG_SESSION 0x0004
+// Data of segments is prefixed with channel and sequence number in channel
+#define RDP_SYN_FLAG_CHANNELS 0x0008
+// Packages after handshake use compact header
+#define RDP_SYN_FLAG_COMPACT 0x0010
+// Fragmented messages are reassembled in message buffer
+#define RDP_SYN_FLAG_MESSAGES 0x0020
+
+// Channel prefix of segment data
+#define RDP_CHANNEL_HEADER_LEN 2
+
+// Longest header: EACK which lists whole window, with session and window
+#define RDP_MAX_HEADER_LEN (RDP_BASE_HEADER_LEN + RDP_SESSION_LEN + 4 * RDP_MAX_OUTSTANGING + 2)
+
+// Header of this version is followed by session identifier of receiver
+#define RDP_VERSION_SESSION 2
+
+// Compact header. The first byte holds the same flags as rdp_header_s
+// with this version, then follow:
+//   low 4 bits of source port << 4 | low 4 bits of destination port
+//   low 8 bits of sequence number
+//   low 8 bits of acknowledgement number
+//   variable header length in 2-byte words, 0x80 if it starts with session
+//   data length, 1 byte below 0x80, else 2 bytes big endian with 0x8000 set
+// Variable header and data are the same as in full package
+#define RDP_VERSION_COMPACT 3
+#define RDP_COMPACT_HEADER_LEN 5
+#define RDP_COMPACT_VAR_SESSION 0x80
+#define RDP_COMPACT_DATA_LIMIT 0x7FFF
+// Ports which fit compact header
+#define RDP_COMPACT_MAX_PORT 0x0F
+
+// NUL,ACK package carries parity of FEC group
+#define RDP_PARITY RDP_NULACK
+
+// Options carried by SYN and SYN,ACK
+struct rdp_syn_options_s {
+    uint16_t outstanding;
+    uint16_t maxsegsize;
+    uint16_t flags;
+    // FEC group size, 0 if FEC is not supported
+    uint16_t fec;
+    // Session identifier of sender, with RDP_SYN_FLAG_SESSION
+    uint32_t session;
+};
+
+// Parity of FEC group. Tag of data segment is 1 | more << 1
+struct rdp_parity_s {
+    uint16_t len_xor;
+    uint8_t tag_xor;
+    uint8_t group;
+};
+
 size_t rdp_build_syn_package(uint8_t *buf, uint8_t src, uint8_t dst,
-                             uint32_t initial_seq);
+                             uint32_t initial_seq,
+                             const struct rdp_syn_options_s *opts,
+                             const uint8_t *data, size_t dlen);
 
 size_t rdp_build_synack_package(uint8_t *buf, uint8_t src, uint8_t dst,
-                                uint32_t initial_seq, uint32_t rcv_seq);
+                                uint32_t initial_seq, uint32_t rcv_seq,
+                                const struct rdp_syn_options_s *opts);
 
 size_t rdp_build_ack_package(uint8_t *buf, uint8_t src, uint8_t dst,
                              uint32_t cur_seq, uint32_t rcv_seq,
@@ -56,7 +123,30 @@ size_t rdb_build_rst_package(uint8_t *buf, uint8_t src, uint8_t dst,
 size_t rdp_build_nul_package(uint8_t *buf, uint8_t src, uint8_t dst,
                              uint32_t cur_seq, uint32_t ack);
 
+size_t rdp_build_probe_package(uint8_t *buf, uint8_t src, uint8_t dst,
+                               uint32_t cur_seq, uint32_t ack, size_t size);
+
 size_t rdp_build_rstack_package(uint8_t *buf, uint8_t src, uint8_t dst,
                                 uint32_t cur_seq, uint32_t rcv_seq);
 
 enum rdp_package_type_e rdp_package_type(const uint8_t *buf);
+
+void rdp_syn_options(const uint8_t *buf, struct rdp_syn_options_s *opts);
+
+size_t rdp_eack_list(const uint8_t *buf, uint32_t *acks, size_t maxacks);
+
+size_t rdp_add_window(uint8_t *buf, size_t len, uint16_t window);
+
+bool rdp_package_window(const uint8_t *buf, uint16_t *window);
+size_t rdp_add_session(uint8_t *buf, size_t len, uint32_t session);
+
+size_t rdp_compact_encode(uint8_t *buf, size_t len);
+size_t rdp_compact_decode(const uint8_t *buf, size_t len, uint8_t *out, size_t outsize,
+                          uint8_t src, uint8_t dst, uint32_t seq_ref, uint32_t ack_ref);
+bool rdp_package_compact(const uint8_t *buf);
+
+size_t rdp_build_parity_package(uint8_t *buf, uint8_t src, uint8_t dst,
+                                uint32_t first_seq, const struct rdp_parity_s *parity,
+                                const uint8_t *data, size_t dlen);
+
+bool rdp_parity_info(const uint8_t *buf, struct rdp_parity_s *parity);
@@ -3,3 +3,4 @@
 #include <defs.h>
 
 void rdb_package_source_destination(const uint8_t *buf, uint8_t *src, uint8_t *dst);
+bool rdp_package_session(const uint8_t *buf, size_t len, uint32_t *session);
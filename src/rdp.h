@@ -8,4 +8,6 @@
 #include <defs.h>
 #include <config.h>
 #include <cycle.h>
+#include <congestion.h>
+#include <ring.h>
 #include <packages_public.h>
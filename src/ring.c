@@ -0,0 +1,44 @@
+#include <ring.h>
+#include <string.h>
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+void rdp_ring_init(struct rdp_ring_s *ring, uint8_t *buf, size_t size)
+{
+    ring->buf = buf;
+    ring->size = buf != NULL ? size : 0;
+    rdp_ring_clear(ring);
+}
+
+void rdp_ring_clear(struct rdp_ring_s *ring)
+{
+    ring->start = 0;
+    ring->len = 0;
+}
+
+size_t rdp_ring_free(const struct rdp_ring_s *ring)
+{
+    return ring->size - ring->len;
+}
+
+size_t rdp_ring_write(struct rdp_ring_s *ring, const uint8_t *data, size_t len)
+{
+    len = min(len, rdp_ring_free(ring));
+    size_t end = (ring->start + ring->len) % (ring->size > 0 ? ring->size : 1);
+    size_t first = min(len, ring->size - end);
+    memcpy(ring->buf + end, data, first);
+    memcpy(ring->buf, data + first, len - first);
+    ring->len += len;
+    return len;
+}
+
+size_t rdp_ring_read(struct rdp_ring_s *ring, uint8_t *data, size_t len)
+{
+    len = min(len, ring->len);
+    size_t first = min(len, ring->size - ring->start);
+    memcpy(data, ring->buf + ring->start, first);
+    memcpy(data + first, ring->buf, len - first);
+    ring->len -= len;
+    ring->start = ring->len > 0 ? (ring->start + len) % ring->size : 0;
+    return len;
+}
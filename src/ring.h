@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Byte ring buffer over user provided memory
+struct rdp_ring_s {
+    uint8_t *buf;
+    size_t size;
+    // Position of the first byte
+    size_t start;
+    // Amount of stored bytes
+    size_t len;
+};
+
+void rdp_ring_init(struct rdp_ring_s *ring, uint8_t *buf, size_t size);
+void rdp_ring_clear(struct rdp_ring_s *ring);
+size_t rdp_ring_free(const struct rdp_ring_s *ring);
+
+// Store up to len bytes, returns amount of stored bytes
+size_t rdp_ring_write(struct rdp_ring_s *ring, const uint8_t *data, size_t len);
+
+// Take up to len bytes, returns amount of taken bytes
+size_t rdp_ring_read(struct rdp_ring_s *ring, uint8_t *data, size_t len);
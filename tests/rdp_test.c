@@ -1,24 +1,47 @@
 #include <stdio.h>
 #include <rdp.h>
+#include <packages.h>
 #include <assert.h>
 #include <string.h>
 
+// Max segment size for tests with larger segments
+#define MAX_MSS 512
+
 struct rdp_connection_s conn1, conn2;
-uint8_t inbuf1[RDP_MAX_SEGMENT_SIZE], inbuf2[RDP_MAX_SEGMENT_SIZE];
-uint8_t outbuf1[RDP_MAX_SEGMENT_SIZE], outbuf2[RDP_MAX_SEGMENT_SIZE];
+uint8_t inbuf1[MAX_MSS], inbuf2[MAX_MSS];
+uint8_t outbuf1[MAX_MSS], outbuf2[MAX_MSS];
+uint8_t winbuf1[RDP_WINDOW_BUFFER_SIZE(MAX_MSS)], winbuf2[RDP_WINDOW_BUFFER_SIZE(MAX_MSS)];
 uint8_t tmp1[RDP_MAX_SEGMENT_SIZE], tmp2[RDP_MAX_SEGMENT_SIZE];
 
 static bool dsc1, dsc2;
+static int ndsc1, ndsc2;
+
+// Datagrams sent by connection, for tests with many packages in flight
+#define MAX_SENT 64
+struct sent_s {
+    uint8_t buf[MAX_SENT][MAX_MSS];
+    size_t len[MAX_SENT];
+    int count;
+} sent1, sent2;
 
 void send_buf(struct rdp_connection_s *conn, const uint8_t *data, size_t len)
 {
+    struct sent_s *sent;
     if (conn == &conn1)
     {
         printf("Connection 1 sends %i bytes: ", len);
+        sent = &sent1;
     }
     else
     {
         printf("Connection 2 sends %i bytes: ", len);        
+        sent = &sent2;
+    }
+    if (sent->count < MAX_SENT)
+    {
+        memcpy(sent->buf[sent->count], data, len);
+        sent->len[sent->count] = len;
+        sent->count++;
     }
     int i;
     for (i = 0; i < len; i++)
@@ -57,17 +80,26 @@ void data_send_completed(struct rdp_connection_s *conn)
     if (conn == &conn1)
     {
         dsc1 = true;
+        ndsc1++;
         printf("Connection 1 send completed\n");
     }
     else
     {
         dsc2 = true;
+        ndsc2++;
         printf("Connection 2 send completed\n");
     }
 }
 
 size_t rcvd;
 
+// All data received by connection 2
+uint8_t rcvlog2[1024];
+size_t rcvlog2_len;
+
+// Connection 2 sends received data back from data_received
+static bool echo2;
+
 void data_received(struct rdp_connection_s *conn, const uint8_t *buf, size_t len)
 {
     int i;
@@ -85,6 +117,13 @@ void data_received(struct rdp_connection_s *conn, const uint8_t *buf, size_t len
     }
     printf("\n");
     rcvd = len;
+    if (conn == &conn2 && rcvlog2_len + len <= sizeof(rcvlog2))
+    {
+        memcpy(rcvlog2 + rcvlog2_len, buf, len);
+        rcvlog2_len += len;
+    }
+    if (conn == &conn2 && echo2)
+        rdp_send(conn, buf, len);
 }
 
 struct rdp_cbs_s cbs = {
@@ -104,14 +143,17 @@ static void set_cbs(struct rdp_connection_s *conn)
     rdp_set_send_cb(conn, send_buf);
 }
 
-void open_connections(void)
+void init_connections(size_t mss1, size_t mss2)
 {
-    rdp_init_connection(&conn1, outbuf1, inbuf1);
-    rdp_init_connection(&conn2, outbuf2, inbuf2);
+    rdp_init_connection(&conn1, outbuf1, inbuf1, winbuf1, mss1);
+    rdp_init_connection(&conn2, outbuf2, inbuf2, winbuf2, mss2);
 
     set_cbs(&conn1);
     set_cbs(&conn2);
+}
 
+void connect_connections(void)
+{
     printf("C2 - listen\n");
     rdp_listen(&conn2, 1);
     
@@ -129,6 +171,17 @@ void open_connections(void)
     rdp_received(&conn2, outbuf1, RDP_MAX_SEGMENT_SIZE);
 }
 
+void open_connections_mss(size_t mss1, size_t mss2)
+{
+    init_connections(mss1, mss2);
+    connect_connections();
+}
+
+void open_connections(void)
+{
+    open_connections_mss(RDP_MAX_SEGMENT_SIZE, RDP_MAX_SEGMENT_SIZE);
+}
+
 void close_connecions()
 {
     printf("C1 - RST send\n");
@@ -163,8 +216,8 @@ void test_connect_listen(void)
      * 4.    OPEN    <SEQ=101><ACK=200> --->                    OPEN
      */
     bool res;
-    rdp_init_connection(&conn1, outbuf1, inbuf1);
-    rdp_init_connection(&conn2, outbuf2, inbuf2);
+    rdp_init_connection(&conn1, outbuf1, inbuf1, winbuf1, RDP_MAX_SEGMENT_SIZE);
+    rdp_init_connection(&conn2, outbuf2, inbuf2, winbuf2, RDP_MAX_SEGMENT_SIZE);
 
     set_cbs(&conn1);
     set_cbs(&conn2);
@@ -245,8 +298,8 @@ void test_connect_connect_1(void)
 {
     printf("\nTEST: Connect : Connect 1\n\n");
     bool res;
-    rdp_init_connection(&conn1, outbuf1, inbuf1);
-    rdp_init_connection(&conn2, outbuf2, inbuf2);
+    rdp_init_connection(&conn1, outbuf1, inbuf1, winbuf1, RDP_MAX_SEGMENT_SIZE);
+    rdp_init_connection(&conn2, outbuf2, inbuf2, winbuf2, RDP_MAX_SEGMENT_SIZE);
 
     set_cbs(&conn1);
     set_cbs(&conn2);
@@ -337,8 +390,8 @@ void test_connect_connect_2(void)
 {
     printf("\nTEST: Connect : Connect 2\n\n");
     bool res;
-    rdp_init_connection(&conn1, outbuf1, inbuf1);
-    rdp_init_connection(&conn2, outbuf2, inbuf2);
+    rdp_init_connection(&conn1, outbuf1, inbuf1, winbuf1, RDP_MAX_SEGMENT_SIZE);
+    rdp_init_connection(&conn2, outbuf2, inbuf2, winbuf2, RDP_MAX_SEGMENT_SIZE);
 
     set_cbs(&conn1);
     set_cbs(&conn2);
@@ -419,8 +472,8 @@ void test_connect_connect_3(void)
 {
     printf("\nTEST: Connect : Connect 3\n\n");
     bool res;
-    rdp_init_connection(&conn1, outbuf1, inbuf1);
-    rdp_init_connection(&conn2, outbuf2, inbuf2);
+    rdp_init_connection(&conn1, outbuf1, inbuf1, winbuf1, RDP_MAX_SEGMENT_SIZE);
+    rdp_init_connection(&conn2, outbuf2, inbuf2, winbuf2, RDP_MAX_SEGMENT_SIZE);
 
     set_cbs(&conn1);
     set_cbs(&conn2);
@@ -759,6 +812,1548 @@ void test_data_send_keepalive_3(void)
     close_connecions();
 }
 
+void test_data_send_window(void)
+{
+    bool res;
+    int i;
+    printf("\nTEST: data send window\n\n");
+    open_connections();
+    ndsc1 = 0;
+    sent1.count = 0;
+    sent2.count = 0;
+
+    printf("*****\n");
+    uint8_t data[RDP_MAX_OUTSTANGING][4];
+
+    // Window is filled without waiting for acknowledgements
+    for (i = 0; i < RDP_MAX_OUTSTANGING; i++)
+    {
+        memset(data[i], i, sizeof(data[i]));
+        res = rdp_send(&conn1, data[i], sizeof(data[i]));
+        assert(res);
+    }
+    assert(!rdp_can_send(&conn1));
+    res = rdp_send(&conn1, data[0], sizeof(data[0]));
+    assert(!res);
+    assert(sent1.count == RDP_MAX_OUTSTANGING);
+
+    for (i = 0; i < RDP_MAX_OUTSTANGING; i++)
+    {
+        rcvd = 0;
+        res = rdp_received(&conn2, sent1.buf[i], sent1.len[i]);
+        assert(res);
+        assert(rcvd == sizeof(data[i]));
+        assert(!memcmp(data[i], inbuf2, rcvd));
+    }
+    rcvd = 0;
+    assert(sent2.count == RDP_MAX_OUTSTANGING);
+
+    // Each acknowledgement frees one slot in window
+    for (i = 0; i < RDP_MAX_OUTSTANGING; i++)
+    {
+        res = rdp_received(&conn1, sent2.buf[i], sent2.len[i]);
+        assert(res);
+        assert(ndsc1 == i + 1);
+        assert(rdp_can_send(&conn1));
+    }
+
+    printf("*****\n");
+    close_connecions();
+}
+void test_data_send_eack(void)
+{
+    bool res;
+    int i;
+    printf("\nTEST: data send eack\n\n");
+    open_connections();
+    ndsc1 = 0;
+    sent1.count = 0;
+    sent2.count = 0;
+    rcvlog2_len = 0;
+
+    printf("*****\n");
+    uint8_t data[] = {0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xCC};
+
+    for (i = 0; i < 4; i++)
+    {
+        res = rdp_send(&conn1, data + i * 3, 3);
+        assert(res);
+    }
+
+    // First segment lost, the rest are buffered by receiver and EACKed
+    for (i = 1; i < 4; i++)
+    {
+        rcvd = 0;
+        res = rdp_received(&conn2, sent1.buf[i], sent1.len[i]);
+        assert(res);
+        assert(rcvd == 0);
+        assert(rdp_package_type(sent2.buf[sent2.count - 1]) == RDP_EACK);
+    }
+    assert(rcvlog2_len == 0);
+
+    res = rdp_received(&conn1, sent2.buf[sent2.count - 1], sent2.len[sent2.count - 1]);
+    assert(res);
+    assert(ndsc1 == 0);
+
+    // Only the lost segment is retransmitted
+    sent1.count = 0;
+    rdp_clock(&conn1, 6000000UL);
+    assert(sent1.count == 1);
+    assert(!memcmp(sent1.buf[0], outbuf1, sent1.len[0]));
+
+    res = rdp_received(&conn2, sent1.buf[0], sent1.len[0]);
+    assert(res);
+    assert(rcvlog2_len == sizeof(data));
+    assert(!memcmp(rcvlog2, data, sizeof(data)));
+    assert(rdp_package_type(sent2.buf[sent2.count - 1]) == RDP_ACK);
+
+    res = rdp_received(&conn1, sent2.buf[sent2.count - 1], sent2.len[sent2.count - 1]);
+    assert(res);
+    assert(ndsc1 == 4);
+
+    printf("*****\n");
+    close_connecions();
+}
+void test_data_send_eack_stale(void)
+{
+    bool res;
+    int i;
+    uint32_t seq;
+    printf("\nTEST: data send stale eack\n\n");
+    open_connections();
+    sent1.count = 0;
+    sent2.count = 0;
+
+    printf("*****\n");
+    uint8_t data[] = {0x11, 0x22, 0x33};
+    for (i = 0; i < 2; i++)
+    {
+        res = rdp_send(&conn1, data, sizeof(data));
+        assert(res);
+    }
+
+    // First segment lost, EACK of the second one is delayed
+    res = rdp_received(&conn2, sent1.buf[1], sent1.len[1]);
+    assert(res);
+    assert(rdp_package_type(sent2.buf[sent2.count - 1]) == RDP_EACK);
+    uint8_t eack[RDP_MAX_SEGMENT_SIZE];
+    size_t eack_len = sent2.len[sent2.count - 1];
+    memcpy(eack, sent2.buf[sent2.count - 1], eack_len);
+
+    res = rdp_received(&conn2, sent1.buf[0], sent1.len[0]);
+    assert(res);
+    res = rdp_received(&conn1, sent2.buf[sent2.count - 1], sent2.len[sent2.count - 1]);
+    assert(res);
+    assert(conn1.snd.una == conn1.snd.nxt);
+
+    // New segments reuse slots of acknowledged ones
+    while (rdp_can_send(&conn1))
+    {
+        res = rdp_send(&conn1, data, sizeof(data));
+        assert(res);
+    }
+    assert(conn1.snd.nxt - conn1.snd.una == RDP_MAX_OUTSTANGING);
+
+    // Delayed EACK doesn't acknowledge segments in reused slots
+    rdp_received(&conn1, eack, eack_len);
+    for (seq = conn1.snd.una; seq != conn1.snd.nxt; seq++)
+        assert(conn1.sndq[seq % RDP_MAX_OUTSTANGING].wait_ack.flag);
+
+    printf("*****\n");
+    close_connecions();
+}
+void test_rtt_estimation(void)
+{
+    bool res;
+    printf("\nTEST: rtt estimation\n\n");
+    open_connections();
+    sent1.count = 0;
+    sent2.count = 0;
+
+    printf("*****\n");
+    uint8_t data[] = {0x11, 0x22, 0x33};
+
+    res = rdp_send(&conn1, data, sizeof(data));
+    assert(res);
+    rdp_clock(&conn1, 4000);
+    res = rdp_received(&conn2, outbuf1, RDP_MAX_SEGMENT_SIZE);
+    assert(res);
+    res = rdp_received(&conn1, outbuf2, RDP_MAX_SEGMENT_SIZE);
+    assert(res);
+    assert(sent1.count == 1);
+    // Handshake was measured with zero delay
+    assert(rdp_rtt(&conn1) == 4000 / 8);
+    int rto = rdp_resend_timeout(&conn1);
+    assert(rto == RDP_MIN_RESEND_TIMEOUT);
+
+    // Retransmission doubles timeout
+    res = rdp_send(&conn1, data, sizeof(data));
+    assert(res);
+    rdp_clock(&conn1, rto + 1);
+    assert(sent1.count == 3);
+    assert(rdp_resend_timeout(&conn1) == 2 * rto);
+
+    // Retransmitted segment is not used for measurement (Karn's rule)
+    res = rdp_received(&conn2, outbuf1, RDP_MAX_SEGMENT_SIZE);
+    assert(res);
+    res = rdp_received(&conn1, outbuf2, RDP_MAX_SEGMENT_SIZE);
+    assert(res);
+    assert(rdp_rtt(&conn1) == 4000 / 8);
+    assert(rdp_resend_timeout(&conn1) == 2 * rto);
+
+    printf("*****\n");
+    close_connecions();
+}
+void test_congestion_control(void)
+{
+    bool res;
+    int i;
+    printf("\nTEST: congestion control\n\n");
+    open_connections();
+    rdp_set_congestion_control(&conn1, &rdp_cc_reno);
+    sent1.count = 0;
+    sent2.count = 0;
+
+    printf("*****\n");
+    uint8_t data[] = {0x11, 0x22, 0x33};
+
+    // Initial window
+    for (i = 0; i < RDP_CC_INITIAL_WINDOW; i++)
+    {
+        res = rdp_send(&conn1, data, sizeof(data));
+        assert(res);
+    }
+    assert(!rdp_can_send(&conn1));
+
+    // Slow start, window grows by acknowledged segment
+    for (i = 0; i < RDP_CC_INITIAL_WINDOW; i++)
+    {
+        res = rdp_received(&conn2, sent1.buf[i], sent1.len[i]);
+        assert(res);
+        res = rdp_received(&conn1, sent2.buf[i], sent2.len[i]);
+        assert(res);
+    }
+    assert(conn1.cc.cwnd == 2 * RDP_CC_INITIAL_WINDOW);
+
+    // Timeout collapses window
+    res = rdp_send(&conn1, data, sizeof(data));
+    assert(res);
+    rdp_clock(&conn1, 6000000UL);
+    assert(conn1.cc.cwnd == 1);
+    assert(conn1.cc.ssthresh == RDP_CC_INITIAL_WINDOW);
+    assert(!rdp_can_send(&conn1));
+
+    printf("*****\n");
+    close_connecions();
+}
+void test_fast_retransmit(void)
+{
+    bool res;
+    int i;
+    printf("\nTEST: fast retransmit\n\n");
+    open_connections();
+    sent1.count = 0;
+    sent2.count = 0;
+    rcvlog2_len = 0;
+
+    printf("*****\n");
+    uint8_t data[] = {0x11, 0x22, 0x33, 0x44, 0x55};
+
+    for (i = 0; i < sizeof(data); i++)
+    {
+        res = rdp_send(&conn1, data + i, 1);
+        assert(res);
+    }
+
+    // First segment lost
+    for (i = 1; i < sizeof(data); i++)
+    {
+        res = rdp_received(&conn2, sent1.buf[i], sent1.len[i]);
+        assert(res);
+    }
+
+    // Lost segment is resent when enough later segments are acknowledged
+    for (i = 0; i < RDP_DUPACK_THRESHOLD; i++)
+    {
+        assert(sent1.count == sizeof(data));
+        res = rdp_received(&conn1, sent2.buf[i], sent2.len[i]);
+        assert(res);
+    }
+    assert(sent1.count == sizeof(data) + 1);
+    assert(((struct rdp_header_s *)sent1.buf[sizeof(data)])->sequence_number ==
+           ((struct rdp_header_s *)sent1.buf[0])->sequence_number);
+
+    // Already resent segment is not resent again by fast retransmit
+    res = rdp_received(&conn1, sent2.buf[RDP_DUPACK_THRESHOLD], sent2.len[RDP_DUPACK_THRESHOLD]);
+    assert(res);
+    assert(sent1.count == sizeof(data) + 1);
+
+    res = rdp_received(&conn2, sent1.buf[sizeof(data)], sent1.len[sizeof(data)]);
+    assert(res);
+    assert(rcvlog2_len == sizeof(data));
+    assert(!memcmp(rcvlog2, data, sizeof(data)));
+
+    printf("*****\n");
+    close_connecions();
+}
+void test_delayed_ack(void)
+{
+    bool res;
+    int i;
+    printf("\nTEST: delayed ack\n\n");
+    open_connections();
+    rdp_set_delayed_ack(&conn2, 2, 2000);
+    sent1.count = 0;
+    sent2.count = 0;
+
+    printf("*****\n");
+    uint8_t data[] = {0x11, 0x22, 0x33, 0x44, 0x55};
+
+    for (i = 0; i < sizeof(data); i++)
+    {
+        res = rdp_send(&conn1, data + i, 1);
+        assert(res);
+    }
+
+    // Every second segment is acknowledged
+    res = rdp_received(&conn2, sent1.buf[0], sent1.len[0]);
+    assert(res);
+    assert(sent2.count == 0);
+    res = rdp_received(&conn2, sent1.buf[1], sent1.len[1]);
+    assert(res);
+    assert(sent2.count == 1);
+
+    // Or after timeout
+    res = rdp_received(&conn2, sent1.buf[2], sent1.len[2]);
+    assert(res);
+    assert(sent2.count == 1);
+    rdp_clock(&conn2, 1000);
+    assert(sent2.count == 1);
+    rdp_clock(&conn2, 1001);
+    assert(sent2.count == 2);
+
+    // Out of order segment is acknowledged immediately
+    res = rdp_received(&conn2, sent1.buf[4], sent1.len[4]);
+    assert(res);
+    assert(sent2.count == 3);
+    assert(rdp_package_type(sent2.buf[2]) == RDP_EACK);
+
+    // And the one filling the gap too
+    res = rdp_received(&conn2, sent1.buf[3], sent1.len[3]);
+    assert(res);
+    assert(sent2.count == 4);
+
+    res = rdp_received(&conn1, sent2.buf[3], sent2.len[3]);
+    assert(res);
+    assert(conn1.snd.una == conn1.snd.nxt);
+
+    printf("*****\n");
+    close_connecions();
+}
+void test_piggyback_ack(void)
+{
+    bool res;
+    printf("\nTEST: piggyback ack\n\n");
+    open_connections();
+    sent1.count = 0;
+    sent2.count = 0;
+    ndsc1 = 0;
+    echo2 = true;
+
+    printf("*****\n");
+    uint8_t data[] = {0x11, 0x22, 0x33};
+
+    res = rdp_send(&conn1, data, sizeof(data));
+    assert(res);
+
+    // Response carries acknowledgement, no bare ACK sent
+    res = rdp_received(&conn2, sent1.buf[0], sent1.len[0]);
+    assert(res);
+    assert(sent2.count == 1);
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)sent2.buf[0];
+    assert(hdr->data_length == sizeof(data));
+    assert(hdr->acknowledgement_number == ((const struct rdp_header_s *)sent1.buf[0])->sequence_number);
+    echo2 = false;
+
+    rcvd = 0;
+    res = rdp_received(&conn1, sent2.buf[0], sent2.len[0]);
+    assert(res);
+    assert(ndsc1 == 1);
+    assert(rcvd == sizeof(data));
+    assert(!memcmp(inbuf1, data, sizeof(data)));
+
+    printf("*****\n");
+    close_connecions();
+}
+void test_max_segment_size(void)
+{
+    bool res;
+    printf("\nTEST: max segment size\n\n");
+    // Segment must hold any header and be multiple of 4
+    res = rdp_init_connection(&conn1, outbuf1, inbuf1, winbuf1, 0);
+    assert(!res);
+    res = rdp_init_connection(&conn1, outbuf1, inbuf1, winbuf1, RDP_MAX_HEADER_LEN);
+    assert(!res);
+    res = rdp_init_connection(&conn1, outbuf1, inbuf1, winbuf1, RDP_MAX_SEGMENT_SIZE + 2);
+    assert(!res);
+    open_connections_mss(MAX_MSS, MAX_MSS / 2);
+    sent1.count = 0;
+    sent2.count = 0;
+
+    printf("*****\n");
+    uint8_t data[MAX_MSS];
+    memset(data, 0x5A, sizeof(data));
+
+    // The smallest of both sides is used. Receive window takes 2 bytes
+    size_t dlen = rdp_max_data_size(&conn1);
+    assert(dlen == MAX_MSS / 2 - sizeof(struct rdp_header_s) - 2);
+    assert(rdp_max_data_size(&conn2) == dlen);
+
+    res = rdp_send(&conn1, data, dlen + 1);
+    assert(!res);
+    res = rdp_send(&conn1, data, dlen);
+    assert(res);
+    assert(sent1.len[0] == MAX_MSS / 2);
+
+    rcvd = 0;
+    res = rdp_received(&conn2, sent1.buf[0], sent1.len[0]);
+    assert(res);
+    assert(rcvd == dlen);
+    assert(!memcmp(data, inbuf2, dlen));
+
+    res = rdp_received(&conn1, sent2.buf[0], sent2.len[0]);
+    assert(res);
+
+    printf("*****\n");
+    close_connecions();
+}
+
+// Deliver sent datagrams to other side, dropping ones larger than limit
+static void deliver_sent(size_t limit)
+{
+    int i1 = 0, i2 = 0;
+    while (i1 < sent1.count || i2 < sent2.count)
+    {
+        if (i1 < sent1.count)
+        {
+            if (sent1.len[i1] <= limit)
+                rdp_received(&conn2, sent1.buf[i1], sent1.len[i1]);
+            i1++;
+        }
+        else
+        {
+            if (sent2.len[i2] <= limit)
+                rdp_received(&conn1, sent2.buf[i2], sent2.len[i2]);
+            i2++;
+        }
+    }
+    sent1.count = 0;
+    sent2.count = 0;
+}
+
+// Send total counters from conn1 to conn2, every third round the first
+// segment is lost. check1 and check2, if not NULL, are called for every
+// package sent by conn1 and conn2
+static void transfer_lossy(int total,
+                           void (*check1)(const uint8_t *buf, size_t len),
+                           void (*check2)(const uint8_t *buf, size_t len))
+{
+    bool res;
+    int i, n = 0, round = 0;
+    rcvlog2_len = 0;
+    while (rcvlog2_len < total * sizeof(uint32_t))
+    {
+        while (n < total && rdp_can_send(&conn1))
+        {
+            uint32_t v = n++;
+            res = rdp_send(&conn1, (const uint8_t *)&v, sizeof(v));
+            assert(res);
+        }
+        for (i = 0; i < sent1.count; i++)
+        {
+            if (check1 != NULL)
+                check1(sent1.buf[i], sent1.len[i]);
+            if (i == 0 && round % 3 == 0)
+                continue;
+            rdp_received(&conn2, sent1.buf[i], sent1.len[i]);
+        }
+        sent1.count = 0;
+        rdp_clock(&conn2, RDP_DELAYED_ACK_TIMEOUT + 1);
+        for (i = 0; i < sent2.count; i++)
+        {
+            if (check2 != NULL)
+                check2(sent2.buf[i], sent2.len[i]);
+            rdp_received(&conn1, sent2.buf[i], sent2.len[i]);
+        }
+        sent2.count = 0;
+        if (conn1.snd.una != conn1.snd.nxt)
+            rdp_clock(&conn1, rdp_resend_timeout(&conn1) + 1);
+        round++;
+        assert(round < 10 * total);
+    }
+    for (i = 0; i < total; i++)
+    {
+        uint32_t v;
+        memcpy(&v, rcvlog2 + i * sizeof(v), sizeof(v));
+        assert(v == i);
+    }
+}
+
+void test_pmtu_probing(void)
+{
+    bool res;
+    int i;
+    const size_t path_mtu = 300;
+    printf("\nTEST: path MTU probing\n\n");
+    open_connections_mss(MAX_MSS, MAX_MSS);
+    rdp_set_pmtu_probing(&conn1, true);
+    sent1.count = 0;
+    sent2.count = 0;
+
+    printf("*****\n");
+    // Header with receive window
+    const size_t hlen = sizeof(struct rdp_header_s) + 2;
+
+    // Search starts from base size
+    assert(rdp_max_data_size(&conn1) == RDP_PMTU_BASE_SIZE - hlen);
+
+    for (i = 0; i < 100; i++)
+    {
+        rdp_clock(&conn1, 20000);
+        rdp_clock(&conn2, 20000);
+        deliver_sent(path_mtu);
+    }
+    assert(conn1.snd.una == conn1.snd.nxt);
+
+    size_t dlen = rdp_max_data_size(&conn1);
+    printf("Path MTU found: %i\n", (int)(dlen + hlen));
+    assert(dlen + hlen <= path_mtu);
+    assert(dlen + hlen > path_mtu - RDP_PMTU_PROBE_STEP);
+
+    // Segment of the found size passes the path
+    uint8_t data[MAX_MSS];
+    memset(data, 0xA5, sizeof(data));
+    rcvd = 0;
+    res = rdp_send(&conn1, data, dlen);
+    assert(res);
+    deliver_sent(path_mtu);
+    assert(rcvd == dlen);
+    assert(conn1.snd.una == conn1.snd.nxt);
+
+    printf("*****\n");
+    rdp_set_pmtu_probing(&conn1, false);
+    close_connecions();
+}
+
+void test_message_send(void)
+{
+    bool res;
+    int i;
+    printf("\nTEST: message send\n\n");
+    init_connections(64, 64);
+    uint8_t msgbuf[1024];
+    rdp_set_message_buffer(&conn2, msgbuf, sizeof(msgbuf));
+    connect_connections();
+    sent1.count = 0;
+    sent2.count = 0;
+    ndsc1 = 0;
+    rcvd = 0;
+    rcvlog2_len = 0;
+
+    printf("*****\n");
+    uint8_t data[1000];
+    for (i = 0; i < sizeof(data); i++)
+        data[i] = i * 7;
+
+    // Message needs more segments than window has
+    res = rdp_send_message(&conn1, data, sizeof(data));
+    assert(res);
+    assert(sent1.count == RDP_MAX_OUTSTANGING);
+    res = rdp_send(&conn1, data, 1);
+    assert(!res);
+
+    // One fragment is lost
+    sent1.len[1] = MAX_MSS + 1;
+    deliver_sent(MAX_MSS);
+
+    for (i = 0; i < 50 && ndsc1 == 0; i++)
+    {
+        rdp_clock(&conn1, 20000);
+        rdp_clock(&conn2, 20000);
+        deliver_sent(MAX_MSS);
+    }
+
+    // Message is delivered at once and completed once
+    assert(ndsc1 == 1);
+    assert(rcvd == sizeof(data));
+    assert(rcvlog2_len == sizeof(data));
+    assert(!memcmp(rcvlog2, data, sizeof(data)));
+
+    // Message which fits one segment
+    res = rdp_send_message(&conn1, data, 10);
+    assert(res);
+    deliver_sent(MAX_MSS);
+    assert(rcvd == 10);
+    assert(ndsc1 == 2);
+
+    // Message larger than message buffer is dropped
+    rdp_set_message_buffer(&conn2, msgbuf, 100);
+    rcvd = 0;
+    res = rdp_send_message(&conn1, data, 200);
+    assert(res);
+    deliver_sent(MAX_MSS);
+    assert(rcvd == 0);
+    assert(ndsc1 == 3);
+
+    // Remote side without message buffer gets only unfragmented messages
+    res = rdp_send_message(&conn2, data, 200);
+    assert(!res);
+    res = rdp_send_message(&conn2, data, 10);
+    assert(res);
+
+    printf("*****\n");
+    rdp_set_message_buffer(&conn2, NULL, 0);
+    close_connecions();
+}
+
+void test_stream(void)
+{
+    int i;
+    printf("\nTEST: byte stream\n\n");
+    open_connections_mss(64, 64);
+    uint8_t sndring1[256], rcvring1[256];
+    uint8_t sndring2[256], rcvring2[300];
+    rdp_set_stream_buffers(&conn1, sndring1, sizeof(sndring1), rcvring1, sizeof(rcvring1));
+    rdp_set_stream_buffers(&conn2, sndring2, sizeof(sndring2), rcvring2, sizeof(rcvring2));
+    sent1.count = 0;
+    sent2.count = 0;
+    rcvd = 0;
+
+    printf("*****\n");
+    uint8_t data[1000], out[1000];
+    for (i = 0; i < sizeof(data); i++)
+        data[i] = i * 13;
+
+    // Accepted data is packetized at once
+    size_t written = rdp_write(&conn1, data, sizeof(data));
+    assert(written == sizeof(sndring1));
+    size_t dsize = rdp_max_data_size(&conn1);
+    assert(sent1.count == (written + dsize - 1) / dsize);
+
+    // Receiver reads slower than sender writes
+    size_t readn = 0;
+    for (i = 0; i < 1000 && readn < sizeof(data); i++)
+    {
+        written += rdp_write(&conn1, data + written, sizeof(data) - written);
+        deliver_sent(MAX_MSS);
+        readn += rdp_read(&conn2, out + readn, 100);
+        rdp_clock(&conn1, 20000);
+        rdp_clock(&conn2, 20000);
+    }
+    assert(written == sizeof(data));
+    assert(readn == sizeof(data));
+    assert(!memcmp(data, out, sizeof(data)));
+    // Stream data doesn't go to data_received
+    assert(rcvd == 0);
+
+    printf("*****\n");
+    rdp_set_stream_buffers(&conn1, NULL, 0, NULL, 0);
+    rdp_set_stream_buffers(&conn2, NULL, 0, NULL, 0);
+    close_connecions();
+}
+
+static int queue_high, queue_low;
+
+void send_queue_level(struct rdp_connection_s *conn, bool high)
+{
+    printf("Connection %i send queue %s\n", conn == &conn1 ? 1 : 2, high ? "high" : "drained");
+    if (high)
+        queue_high++;
+    else
+        queue_low++;
+}
+
+void test_send_queue(void)
+{
+    bool res;
+    int i, n;
+    printf("\nTEST: send queue\n\n");
+    open_connections();
+    uint8_t queue[256];
+    rdp_set_send_queue(&conn1, queue, sizeof(queue), 40);
+    rdp_set_send_queue_level_cb(&conn1, send_queue_level);
+    sent1.count = 0;
+    sent2.count = 0;
+    rcvlog2_len = 0;
+    queue_high = 0;
+    queue_low = 0;
+
+    printf("*****\n");
+    uint8_t data[20];
+
+    // Segments which don't fit window are queued until queue is full
+    for (n = 0; ; n++)
+    {
+        memset(data, n, sizeof(data));
+        res = rdp_send(&conn1, data, sizeof(data));
+        if (!res)
+            break;
+    }
+    assert(sent1.count == RDP_MAX_OUTSTANGING);
+    assert(n == RDP_MAX_OUTSTANGING + sizeof(queue) / (sizeof(data) + 2));
+    assert(queue_high == 1);
+    assert(queue_low == 0);
+
+    // Queue is drained by acknowledgements
+    for (i = 0; i < 10 && sent1.count > 0; i++)
+        deliver_sent(MAX_MSS);
+    assert(queue_low == 1);
+    assert(conn1.snd.una == conn1.snd.nxt);
+    assert(rcvlog2_len == n * sizeof(data));
+    for (i = 0; i < n; i++)
+        assert(rcvlog2[i * sizeof(data)] == i);
+
+    printf("*****\n");
+    rdp_set_send_queue(&conn1, NULL, 0, 0);
+    close_connecions();
+}
+
+void test_flow_control(void)
+{
+    bool res;
+    int i;
+    printf("\nTEST: flow control\n\n");
+    open_connections();
+    sent1.count = 0;
+    sent2.count = 0;
+    rcvlog2_len = 0;
+
+    printf("*****\n");
+    uint8_t data[20];
+    rdp_pause_delivery(&conn2);
+
+    // Paused receiver keeps data and closes window
+    for (i = 0; i < 3; i++)
+    {
+        memset(data, i, sizeof(data));
+        res = rdp_send(&conn1, data, sizeof(data));
+        assert(res);
+    }
+    deliver_sent(MAX_MSS);
+    assert(rcvlog2_len == 0);
+    assert(conn1.snd.wnd == 3);
+    assert(!rdp_can_send(&conn1));
+
+    // Held segments are not resent
+    rdp_clock(&conn1, RDP_RESEND_TIMEOUT * 2);
+    assert(sent1.count == 0);
+
+    // Data is delivered on resume and window is opened
+    rdp_resume_delivery(&conn2);
+    assert(rcvlog2_len == 3 * sizeof(data));
+    for (i = 0; i < 3; i++)
+        assert(rcvlog2[i * sizeof(data)] == i);
+    deliver_sent(MAX_MSS);
+    assert(conn1.snd.wnd == RDP_MAX_OUTSTANGING);
+    assert(conn1.snd.una == conn1.snd.nxt);
+    assert(rdp_can_send(&conn1));
+
+    // Window updates are not counted as duplicate acknowledgements
+    memset(data, 3, sizeof(data));
+    res = rdp_send(&conn1, data, sizeof(data));
+    assert(res);
+    sent1.count = 0;
+    uint8_t pkg[RDP_MAX_SEGMENT_SIZE];
+    size_t len;
+    for (i = 0; i < RDP_DUPACK_THRESHOLD; i++)
+    {
+        len = rdp_build_ack_package(pkg, 1, 2, conn2.snd.nxt, conn2.rcv.cur, NULL, 0);
+        len = rdp_add_window(pkg, len, RDP_MAX_OUTSTANGING - 1 - i);
+        rdp_received(&conn1, pkg, len);
+    }
+    assert(conn1.snd.dupacks == 0);
+    assert(sent1.count == 0);
+
+    // Acknowledgements with the same window are duplicates
+    for (i = 0; i < RDP_DUPACK_THRESHOLD; i++)
+        rdp_received(&conn1, pkg, len);
+    assert(sent1.count == 1);
+    deliver_sent(MAX_MSS);
+    assert(conn1.snd.una == conn1.snd.nxt);
+
+    printf("*****\n");
+    close_connecions();
+}
+
+void test_unordered_delivery(void)
+{
+    bool res;
+    int i;
+    printf("\nTEST: unordered delivery\n\n");
+
+    // Sequenced delivery is used if one side requires it
+    init_connections(RDP_MAX_SEGMENT_SIZE, RDP_MAX_SEGMENT_SIZE);
+    rdp_set_sequenced_delivery(&conn1, false);
+    connect_connections();
+    assert(!conn1.unordered && !conn2.unordered);
+    close_connecions();
+
+    init_connections(RDP_MAX_SEGMENT_SIZE, RDP_MAX_SEGMENT_SIZE);
+    rdp_set_sequenced_delivery(&conn1, false);
+    rdp_set_sequenced_delivery(&conn2, false);
+    connect_connections();
+    assert(conn1.unordered && conn2.unordered);
+    sent1.count = 0;
+    sent2.count = 0;
+    rcvlog2_len = 0;
+
+    printf("*****\n");
+    uint8_t data[20];
+    for (i = 0; i < 3; i++)
+    {
+        memset(data, i, sizeof(data));
+        res = rdp_send(&conn1, data, sizeof(data));
+        assert(res);
+    }
+
+    // First segment is lost, others are delivered at once
+    sent1.len[0] = MAX_MSS + 1;
+    deliver_sent(MAX_MSS);
+    assert(rcvlog2_len == 2 * sizeof(data));
+    assert(rcvlog2[0] == 1);
+    assert(rcvlog2[sizeof(data)] == 2);
+
+    // Lost segment is resent and delivered once
+    rdp_clock(&conn1, RDP_RESEND_TIMEOUT * 2);
+    deliver_sent(MAX_MSS);
+    assert(rcvlog2_len == 3 * sizeof(data));
+    assert(rcvlog2[2 * sizeof(data)] == 0);
+    assert(conn1.snd.una == conn1.snd.nxt);
+    assert(conn2.rcv.cur == conn1.snd.nxt - 1);
+
+    printf("*****\n");
+    close_connecions();
+}
+
+static int ndropped;
+
+void data_dropped(struct rdp_connection_s *conn, const uint8_t *data, size_t len)
+{
+    printf("Connection %i dropped %i bytes\n", conn == &conn1 ? 1 : 2, (int)len);
+    ndropped++;
+}
+
+void test_partial_reliability(void)
+{
+    bool res;
+    printf("\nTEST: partial reliability\n\n");
+    open_connections();
+    rdp_set_data_dropped_cb(&conn1, data_dropped);
+    sent1.count = 0;
+    sent2.count = 0;
+    rcvlog2_len = 0;
+    ndropped = 0;
+    ndsc1 = 0;
+
+    printf("*****\n");
+    uint8_t data[20];
+    const int ttl = RDP_RESEND_TIMEOUT / 2;
+
+    uint8_t lost[30];
+    memset(lost, 1, sizeof(lost));
+    res = rdp_send_ttl(&conn1, lost, sizeof(lost), ttl);
+    assert(res);
+    memset(data, 2, sizeof(data));
+    res = rdp_send(&conn1, data, sizeof(data));
+    assert(res);
+
+    // Segment with ttl and its retransmissions are lost
+    const size_t limit = sent1.len[0] - 1;
+    deliver_sent(limit);
+    assert(rcvlog2_len == 0);
+
+    rdp_clock(&conn1, ttl / 2);
+    deliver_sent(limit);
+    assert(ndropped == 0);
+    rdp_clock(&conn1, ttl / 2 + 1);
+    assert(ndropped == 1);
+
+    // Remote side skips dropped segment and gets the next one
+    deliver_sent(limit);
+    assert(rcvlog2_len == sizeof(data));
+    assert(rcvlog2[0] == 2);
+    assert(conn1.snd.una == conn1.snd.nxt);
+    assert(ndsc1 == 1);
+
+    // Segment acknowledged in time is not dropped
+    res = rdp_send_ttl(&conn1, data, sizeof(data), ttl);
+    assert(res);
+    deliver_sent(MAX_MSS);
+    rdp_clock(&conn1, ttl * 2);
+    assert(ndropped == 1);
+    assert(ndsc1 == 2);
+
+    printf("*****\n");
+    rdp_set_data_dropped_cb(&conn1, NULL);
+    close_connecions();
+}
+
+void test_fec(void)
+{
+    bool res;
+    int i;
+    const int group = 4;
+    printf("\nTEST: forward error correction\n\n");
+    uint8_t fecbuf1[RDP_FEC_BUFFER_SIZE(RDP_MAX_SEGMENT_SIZE)];
+    uint8_t fecbuf2[RDP_FEC_BUFFER_SIZE(RDP_MAX_SEGMENT_SIZE)];
+    init_connections(RDP_MAX_SEGMENT_SIZE, RDP_MAX_SEGMENT_SIZE);
+    rdp_set_fec(&conn1, fecbuf1, group);
+    rdp_set_fec(&conn2, fecbuf2, group);
+    connect_connections();
+    sent1.count = 0;
+    sent2.count = 0;
+    rcvlog2_len = 0;
+
+    printf("*****\n");
+    uint8_t data[40];
+    for (i = 0; i < group; i++)
+    {
+        memset(data, i + 1, sizeof(data));
+        // Segments of different length
+        res = rdp_send(&conn1, data, sizeof(data) - i * 3);
+        assert(res);
+    }
+    // Parity follows the group
+    assert(sent1.count == group + 1);
+    assert(rdp_package_type(sent1.buf[group]) == RDP_PARITY);
+    assert(rdp_fec_stats(&conn1)->parity_sent == 1);
+
+    // Lost segment is rebuilt from parity without retransmission
+    sent1.len[1] = MAX_MSS + 1;
+    deliver_sent(MAX_MSS);
+    assert(rdp_fec_stats(&conn2)->parity_received == 1);
+    assert(rdp_fec_stats(&conn2)->recovered == 1);
+    assert(conn1.snd.una == conn1.snd.nxt);
+    size_t pos = 0;
+    for (i = 0; i < group; i++)
+    {
+        assert(rcvlog2[pos] == i + 1);
+        pos += sizeof(data) - i * 3;
+    }
+    assert(rcvlog2_len == pos);
+
+    // Two lost segments of group are resent
+    for (i = 0; i < group; i++)
+    {
+        memset(data, i + 1, sizeof(data));
+        res = rdp_send(&conn1, data, sizeof(data));
+        assert(res);
+    }
+    sent1.len[0] = MAX_MSS + 1;
+    sent1.len[2] = MAX_MSS + 1;
+    deliver_sent(MAX_MSS);
+    assert(rdp_fec_stats(&conn2)->recovered == 1);
+    rdp_clock(&conn1, RDP_RESEND_TIMEOUT * 2);
+    deliver_sent(MAX_MSS);
+    assert(conn1.snd.una == conn1.snd.nxt);
+    assert(rcvlog2_len == pos + group * sizeof(data));
+
+    printf("*****\n");
+    close_connecions();
+}
+
+void test_pacing(void)
+{
+    bool res;
+    int i;
+    printf("\nTEST: pacing\n\n");
+    open_connections();
+    uint8_t queue[512];
+    rdp_set_send_queue(&conn1, queue, sizeof(queue), sizeof(queue));
+    // Segment fits 12 ms
+    rdp_set_pacing(&conn1, true, 10000);
+    sent1.count = 0;
+    sent2.count = 0;
+
+    printf("*****\n");
+    uint8_t data[100];
+    memset(data, 0x33, sizeof(data));
+    for (i = 0; i < 6; i++)
+    {
+        res = rdp_send(&conn1, data, sizeof(data));
+        assert(res);
+    }
+
+    // Burst is limited, the rest is queued
+    int burst = sent1.count;
+    assert(burst > 0 && burst <= RDP_PACING_BURST + 1);
+    deliver_sent(MAX_MSS);
+
+    // One segment per clock
+    for (i = burst; i < 6; i++)
+    {
+        rdp_clock(&conn1, 12000);
+        assert(sent1.count == 1);
+        deliver_sent(MAX_MSS);
+    }
+    assert(conn1.snd.una == conn1.snd.nxt);
+
+    printf("*****\n");
+    rdp_set_pacing(&conn1, false, 0);
+    rdp_set_send_queue(&conn1, NULL, 0, 0);
+    close_connecions();
+}
+
+void test_coalescing(void)
+{
+    bool res;
+    int i;
+    // Shorter than resend timeout
+    const int delay = RDP_MIN_RESEND_TIMEOUT / 2;
+    printf("\nTEST: coalescing\n\n");
+    open_connections();
+    uint8_t cbuf[RDP_MAX_SEGMENT_SIZE];
+    rdp_set_coalescing(&conn1, cbuf, delay);
+    sent1.count = 0;
+    sent2.count = 0;
+    rcvlog2_len = 0;
+
+    printf("*****\n");
+    uint8_t record[8];
+
+    // The first write is sent at once, next ones wait for acknowledgement
+    for (i = 0; i < 10; i++)
+    {
+        memset(record, i, sizeof(record));
+        res = rdp_send(&conn1, record, sizeof(record));
+        assert(res);
+    }
+    assert(sent1.count == 1);
+    deliver_sent(MAX_MSS);
+    assert(rcvlog2_len == 10 * sizeof(record));
+    for (i = 0; i < 10; i++)
+        assert(rcvlog2[i * sizeof(record)] == i);
+
+    // Flush sends coalesced data while data is in flight
+    res = rdp_send(&conn1, record, sizeof(record));
+    assert(res);
+    res = rdp_send(&conn1, record, sizeof(record));
+    assert(res);
+    res = rdp_send(&conn1, record, sizeof(record));
+    assert(res);
+    assert(sent1.count == 1);
+    res = rdp_flush(&conn1);
+    assert(res);
+    assert(sent1.count == 2);
+    assert(sent1.len[1] == sent1.len[0] + sizeof(record));
+    deliver_sent(MAX_MSS);
+
+    // Max delay bounds waiting for acknowledgement
+    res = rdp_send(&conn1, record, sizeof(record));
+    assert(res);
+    res = rdp_send(&conn1, record, sizeof(record));
+    assert(res);
+    assert(sent1.count == 1);
+    rdp_clock(&conn1, delay / 2);
+    assert(sent1.count == 1);
+    rdp_clock(&conn1, delay / 2);
+    assert(sent1.count == 2);
+    deliver_sent(MAX_MSS);
+    assert(rcvlog2_len == 15 * sizeof(record));
+    assert(conn1.snd.una == conn1.snd.nxt);
+
+    printf("*****\n");
+    rdp_set_coalescing(&conn1, NULL, 0);
+    close_connecions();
+}
+
+void test_zero_rtt(void)
+{
+    bool res;
+    printf("\nTEST: zero rtt\n\n");
+    init_connections(RDP_MAX_SEGMENT_SIZE, RDP_MAX_SEGMENT_SIZE);
+    sent1.count = 0;
+    sent2.count = 0;
+    rcvlog2_len = 0;
+    rcvd = 0;
+    ndsc1 = 0;
+    ndsc2 = 0;
+    echo2 = true;
+
+    printf("*****\n");
+    uint8_t data[] = {0x11, 0x22, 0x33};
+
+    // SYN data must fit segment
+    uint8_t big[RDP_MAX_SEGMENT_SIZE];
+    res = rdp_connect_data(&conn1, 2, 1, big, sizeof(big));
+    assert(!res);
+    assert(conn1.state == RDP_CLOSED);
+
+    rdp_listen(&conn2, 1);
+    res = rdp_connect_data(&conn1, 2, 1, data, sizeof(data));
+    assert(res);
+    assert(sent1.count == 1);
+
+    // Request is delivered when SYN is accepted, response rides in SYN,ACK
+    res = rdp_received(&conn2, sent1.buf[0], sent1.len[0]);
+    assert(res);
+    assert(conn2.state == RDP_SYN_RCVD);
+    assert(rcvlog2_len == sizeof(data));
+    assert(!memcmp(rcvlog2, data, sizeof(data)));
+    assert(sent2.count == 1);
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)sent2.buf[0];
+    assert(hdr->syn && hdr->ack);
+    assert(hdr->data_length == sizeof(data));
+
+    // Repeated SYN is not delivered again
+    res = rdp_received(&conn2, sent1.buf[0], sent1.len[0]);
+    assert(res);
+    assert(rcvlog2_len == sizeof(data));
+    assert(sent2.count == 2);
+    assert(sent2.len[1] == sent2.len[0]);
+    echo2 = false;
+
+    res = rdp_received(&conn1, sent2.buf[0], sent2.len[0]);
+    assert(res);
+    assert(conn1.state == RDP_OPEN);
+    assert(rcvd == sizeof(data));
+    // Both request and response are acknowledged by handshake
+    assert(ndsc1 == 1);
+    res = rdp_received(&conn2, outbuf1, RDP_MAX_SEGMENT_SIZE);
+    assert(res);
+    assert(conn2.state == RDP_OPEN);
+    assert(ndsc2 == 1);
+
+    printf("*****\n");
+    close_connecions();
+}
+
+void test_graceful_close(void)
+{
+    bool res;
+    int i;
+    printf("\nTEST: graceful close\n\n");
+    open_connections();
+    rdp_set_linger(&conn1, true, 0);
+    sent1.count = 0;
+    sent2.count = 0;
+    rcvlog2_len = 0;
+
+    printf("*****\n");
+    uint8_t data[] = {0x11, 0x22, 0x33};
+
+    // RST waits for acknowledgement of data in flight
+    for (i = 0; i < 3; i++)
+    {
+        res = rdp_send(&conn1, data, sizeof(data));
+        assert(res);
+    }
+    res = rdp_close(&conn1);
+    assert(res);
+    assert(conn1.state == RDP_OPEN);
+    assert(sent1.count == 3);
+    res = rdp_send(&conn1, data, sizeof(data));
+    assert(!res);
+    deliver_sent(MAX_MSS);
+    assert(rcvlog2_len == 3 * sizeof(data));
+    assert(conn1.state == RDP_CLOSED);
+    assert(conn2.state == RDP_CLOSED);
+
+    // Linger timeout drops data which is not acknowledged
+    open_connections();
+    rdp_set_linger(&conn1, true, RDP_CLOSE_TIMEOUT / 2);
+    sent1.count = 0;
+    res = rdp_send(&conn1, data, sizeof(data));
+    assert(res);
+    res = rdp_close(&conn1);
+    assert(res);
+    assert(conn1.state == RDP_OPEN);
+    rdp_clock(&conn1, RDP_CLOSE_TIMEOUT / 4);
+    assert(conn1.state == RDP_OPEN);
+    rdp_clock(&conn1, RDP_CLOSE_TIMEOUT / 4 + 1);
+    assert(conn1.state == RDP_ACTIVE_CLOSE_WAIT);
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)outbuf1;
+    assert(hdr->rst);
+
+    printf("*****\n");
+    rdp_set_linger(&conn1, false, 0);
+}
+
+void test_fast_recycle(void)
+{
+    bool res;
+    printf("\nTEST: fast recycle\n\n");
+    init_connections(RDP_MAX_SEGMENT_SIZE, RDP_MAX_SEGMENT_SIZE);
+    rdp_set_fast_recycle(&conn1, true);
+    rdp_set_fast_recycle(&conn2, true);
+    connect_connections();
+    sent1.count = 0;
+    sent2.count = 0;
+
+    printf("*****\n");
+    // Passive side is closed at once and listens again
+    res = rdp_close(&conn1);
+    assert(res);
+    res = rdp_received(&conn2, sent1.buf[0], sent1.len[0]);
+    assert(res);
+    assert(conn2.state == RDP_CLOSED);
+    assert(sent2.count == 1);
+    res = rdp_listen(&conn2, 1);
+    assert(res);
+
+    // RST,ACK is lost, repeated RST is answered by record
+    rdp_clock(&conn1, rdp_resend_timeout(&conn1) + 1);
+    assert(sent1.count == 2);
+    res = rdp_received(&conn2, sent1.buf[1], sent1.len[1]);
+    assert(res);
+    assert(conn2.state == RDP_LISTEN);
+    assert(sent2.count == 2);
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)sent2.buf[1];
+    const struct rdp_header_s *first = (const struct rdp_header_s *)sent2.buf[0];
+    assert(hdr->rst && hdr->ack);
+    assert(hdr->sequence_number == first->sequence_number);
+    assert(hdr->acknowledgement_number == first->acknowledgement_number);
+    res = rdp_received(&conn1, sent2.buf[1], sent2.len[1]);
+    assert(res);
+    assert(conn1.state == RDP_CLOSED);
+
+    // Final ACK is lost, repeated RST,ACK is answered by record
+    res = rdp_received(&conn1, sent2.buf[1], sent2.len[1]);
+    assert(res);
+    assert(sent1.count == 4);
+    hdr = (const struct rdp_header_s *)sent1.buf[3];
+    first = (const struct rdp_header_s *)sent1.buf[2];
+    assert(hdr->ack && !hdr->rst);
+    assert(hdr->sequence_number == first->sequence_number);
+    assert(hdr->acknowledgement_number == first->acknowledgement_number);
+
+    // New connection on the same ports is accepted
+    connect_connections();
+    assert(conn1.state == RDP_OPEN);
+    assert(conn2.state == RDP_OPEN);
+
+    printf("*****\n");
+    close_connecions();
+}
+
+void test_sequence_wrap(void)
+{
+    const int total = 200;
+    printf("\nTEST: sequence wrap\n\n");
+    init_connections(RDP_MAX_SEGMENT_SIZE, RDP_MAX_SEGMENT_SIZE);
+    // Sequence numbers cross 2^32 during transfer
+    conn1.snd.iss = 0xFFFFFFFFu - total / 2;
+    conn2.snd.iss = 0xFFFFFFFFu;
+    connect_connections();
+    assert(conn1.state == RDP_OPEN);
+    assert(conn2.state == RDP_OPEN);
+    sent1.count = 0;
+    sent2.count = 0;
+
+    printf("*****\n");
+    transfer_lossy(total, NULL, NULL);
+    assert(conn1.snd.nxt < conn1.snd.iss);
+
+    printf("*****\n");
+    close_connecions();
+}
+
+// Transport finds connection by session identifier of package
+static struct rdp_connection_s *session_lookup(const uint8_t *buf, size_t len)
+{
+    uint32_t id;
+    if (!rdp_package_session(buf, len, &id))
+        return NULL;
+    if (id == conn1.session.local)
+        return &conn1;
+    if (id == conn2.session.local)
+        return &conn2;
+    return NULL;
+}
+
+void test_session_migration(void)
+{
+    int i;
+    bool res;
+    printf("\nTEST: session migration\n\n");
+    init_connections(RDP_MAX_SEGMENT_SIZE, RDP_MAX_SEGMENT_SIZE);
+    rdp_set_session_id(&conn1, 0x1111);
+    rdp_set_session_id(&conn2, 0x2222);
+    connect_connections();
+    assert(conn1.state == RDP_OPEN);
+    assert(conn2.state == RDP_OPEN);
+    assert(conn1.session.remote == 0x2222);
+    assert(conn2.session.remote == 0x1111);
+    assert(rdp_max_data_size(&conn1) == RDP_MAX_SEGMENT_SIZE - sizeof(struct rdp_header_s) - 2 - 4);
+    sent1.count = 0;
+    sent2.count = 0;
+    rcvlog2_len = 0;
+
+    printf("*****\n");
+    uint8_t data[RDP_MAX_SEGMENT_SIZE];
+    memset(data, 0x55, sizeof(data));
+    for (i = 0; i < 3; i++)
+    {
+        res = rdp_send(&conn1, data, rdp_max_data_size(&conn1));
+        assert(res);
+    }
+    assert(sent1.count == 3);
+    for (i = 0; i < 3; i++)
+        assert(sent1.len[i] == RDP_MAX_SEGMENT_SIZE);
+
+    // Packages come from new address and are routed by session,
+    // the first one is lost
+    for (i = 1; i < 3; i++)
+    {
+        assert(session_lookup(sent1.buf[i], sent1.len[i]) == &conn2);
+        res = rdp_received(&conn2, sent1.buf[i], sent1.len[i]);
+        assert(res);
+    }
+    assert(sent2.count == 2);
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)sent2.buf[1];
+    assert(hdr->eack);
+    assert(session_lookup(sent2.buf[1], sent2.len[1]) == &conn1);
+    res = rdp_received(&conn1, sent2.buf[1], sent2.len[1]);
+    assert(res);
+
+    // Only the lost segment is retransmitted
+    rdp_clock(&conn1, rdp_resend_timeout(&conn1) + 1);
+    assert(sent1.count == 4);
+    res = rdp_received(&conn2, sent1.buf[3], sent1.len[3]);
+    assert(res);
+    assert(rcvlog2_len == 3 * rdp_max_data_size(&conn1));
+
+    // Package of another session is dropped
+    uint8_t pkg[RDP_MAX_SEGMENT_SIZE];
+    memcpy(pkg, sent1.buf[3], sent1.len[3]);
+    uint32_t other = 0x3333;
+    memcpy(pkg + sizeof(struct rdp_header_s), &other, sizeof(other));
+    assert(session_lookup(pkg, sent1.len[3]) == NULL);
+    res = rdp_received(&conn2, pkg, sent1.len[3]);
+    assert(!res);
+
+    printf("*****\n");
+    close_connecions();
+}
+
+// Channels and first bytes of data received by connection 2
+static uint8_t chlog[64][2];
+static int nchlog;
+
+void channel_received(struct rdp_connection_s *conn, uint8_t channel, const uint8_t *data, size_t len)
+{
+    printf("Connection %i received %i bytes in channel %i\n", conn == &conn1 ? 1 : 2, (int)len, channel);
+    if (conn == &conn2 && nchlog < 64)
+    {
+        chlog[nchlog][0] = channel;
+        chlog[nchlog][1] = data[0];
+        nchlog++;
+    }
+}
+
+// Channel of sent package
+static uint8_t sent_channel(const uint8_t *buf)
+{
+    const struct rdp_header_s *hdr = (const struct rdp_header_s *)buf;
+    return buf[hdr->header_length * 2];
+}
+
+void test_channels(void)
+{
+    int i;
+    bool res;
+    printf("\nTEST: channels\n\n");
+    init_connections(RDP_MAX_SEGMENT_SIZE, RDP_MAX_SEGMENT_SIZE);
+    uint8_t q1[256], q2[256];
+    // Control channel 1 has higher priority than bulk channel 2
+    res = rdp_set_channel(&conn1, 1, 10, q1, sizeof(q1));
+    assert(res);
+    res = rdp_set_channel(&conn1, 2, -10, q2, sizeof(q2));
+    assert(res);
+    res = rdp_set_channel(&conn1, RDP_MAX_CHANNELS, 0, NULL, 0);
+    assert(!res);
+    res = rdp_set_channel(&conn2, 0, 0, NULL, 0);
+    assert(res);
+    rdp_set_channel_received_cb(&conn2, channel_received);
+    uint8_t msgbuf[256];
+    rdp_set_message_buffer(&conn2, msgbuf, sizeof(msgbuf));
+    connect_connections();
+    assert(conn1.channels.enabled);
+    assert(conn2.channels.enabled);
+    sent1.count = 0;
+    sent2.count = 0;
+    nchlog = 0;
+
+    printf("*****\n");
+    uint8_t data[4];
+
+    // Lost bulk segment doesn't block control one
+    data[0] = 0xB1;
+    res = rdp_send_channel(&conn1, 2, data, sizeof(data));
+    assert(res);
+    data[0] = 0xC1;
+    res = rdp_send_channel(&conn1, 1, data, sizeof(data));
+    assert(res);
+    data[0] = 0xB2;
+    res = rdp_send_channel(&conn1, 2, data, sizeof(data));
+    assert(res);
+    assert(sent1.count == 3);
+    assert(sent_channel(sent1.buf[0]) == 2);
+    assert(sent_channel(sent1.buf[1]) == 1);
+    res = rdp_received(&conn2, sent1.buf[1], sent1.len[1]);
+    assert(res);
+    assert(nchlog == 1 && chlog[0][0] == 1 && chlog[0][1] == 0xC1);
+
+    // Bulk segment waits for the lost one of its channel
+    res = rdp_received(&conn2, sent1.buf[2], sent1.len[2]);
+    assert(res);
+    assert(nchlog == 1);
+    res = rdp_received(&conn2, sent1.buf[0], sent1.len[0]);
+    assert(res);
+    assert(nchlog == 3);
+    assert(chlog[1][0] == 2 && chlog[1][1] == 0xB1);
+    assert(chlog[2][0] == 2 && chlog[2][1] == 0xB2);
+    sent1.count = 0;
+    deliver_sent(MAX_MSS);
+    assert(conn1.snd.una == conn1.snd.nxt);
+
+    // Window is filled with bulk data, queued control segments are sent first
+    data[0] = 0xB0;
+    while (rdp_can_send(&conn1))
+    {
+        res = rdp_send_channel(&conn1, 2, data, sizeof(data));
+        assert(res);
+    }
+    int inflight = sent1.count;
+    for (i = 0; i < 2; i++)
+    {
+        res = rdp_send_channel(&conn1, 2, data, sizeof(data));
+        assert(res);
+    }
+    data[0] = 0xC0;
+    for (i = 0; i < 2; i++)
+    {
+        res = rdp_send_channel(&conn1, 1, data, sizeof(data));
+        assert(res);
+    }
+    assert(sent1.count == inflight);
+    nchlog = 0;
+    deliver_sent(MAX_MSS);
+    assert(nchlog == inflight + 4);
+    assert(chlog[inflight][0] == 1 && chlog[inflight + 1][0] == 1);
+    assert(chlog[inflight + 2][0] == 2 && chlog[inflight + 3][0] == 2);
+    assert(conn1.snd.una == conn1.snd.nxt);
+
+    // Lost fragment of message in channel 0 doesn't block control segment
+    uint8_t msg[150];
+    memset(msg, 0x5A, sizeof(msg));
+    res = rdp_send_message(&conn1, msg, sizeof(msg));
+    assert(res);
+    data[0] = 0xC2;
+    res = rdp_send_channel(&conn1, 1, data, sizeof(data));
+    assert(res);
+    assert(sent1.count == 3);
+    assert(sent_channel(sent1.buf[0]) == 0 && sent_channel(sent1.buf[2]) == 1);
+    nchlog = 0;
+    rcvd = 0;
+    res = rdp_received(&conn2, sent1.buf[1], sent1.len[1]);
+    assert(res);
+    res = rdp_received(&conn2, sent1.buf[2], sent1.len[2]);
+    assert(res);
+    assert(nchlog == 1 && chlog[0][1] == 0xC2);
+    assert(rcvd == 0);
+    res = rdp_received(&conn2, sent1.buf[0], sent1.len[0]);
+    assert(res);
+    assert(rcvd == sizeof(msg));
+    assert(nchlog == 1);
+    sent1.count = 0;
+    deliver_sent(MAX_MSS);
+    assert(conn1.snd.una == conn1.snd.nxt);
+
+    printf("*****\n");
+    close_connecions();
+}
+
+static void check_compact_sent1(const uint8_t *buf, size_t len)
+{
+    uint8_t src, dst;
+    // Data segment or bare ACK
+    assert(len == 6 + 4 + 2 + sizeof(uint32_t) || len == 6 + 4 + 2);
+    rdb_package_source_destination(buf, &src, &dst);
+    assert(src == 2 && dst == 1);
+    assert(session_lookup(buf, len) == &conn2);
+}
+
+static void check_compact_sent2(const uint8_t *buf, size_t len)
+{
+    (void)len;
+    assert(rdp_package_compact(buf));
+}
+
+void test_compact_header(void)
+{
+    const int total = 256;
+    bool res;
+    printf("\nTEST: compact header\n\n");
+    init_connections(RDP_MAX_SEGMENT_SIZE, RDP_MAX_SEGMENT_SIZE);
+    rdp_set_compact_header(&conn1, tmp1);
+    rdp_set_compact_header(&conn2, tmp2);
+    rdp_set_session_id(&conn1, 0x1111);
+    rdp_set_session_id(&conn2, 0x2222);
+    connect_connections();
+    assert(conn1.state == RDP_OPEN);
+    assert(conn2.state == RDP_OPEN);
+    assert(conn1.compact.enabled);
+    assert(conn2.compact.enabled);
+    // ACK of handshake: 6 bytes of header, session and window
+    assert(rdp_package_compact(outbuf1));
+    assert(conn1.out_data_length == 6 + 4 + 2);
+    sent1.count = 0;
+    sent2.count = 0;
+
+    printf("*****\n");
+    // Low 8 bits of sequence numbers wrap several times
+    transfer_lossy(total, check_compact_sent1, check_compact_sent2);
+
+    // Package for another port is dropped
+    uint32_t v = 0;
+    res = rdp_send(&conn1, (const uint8_t *)&v, sizeof(v));
+    assert(res);
+    uint8_t pkg[RDP_MAX_SEGMENT_SIZE];
+    memcpy(pkg, sent1.buf[0], sent1.len[0]);
+    pkg[1] = 0x23;
+    rcvd = 0;
+    res = rdp_received(&conn2, pkg, sent1.len[0]);
+    assert(!res);
+    res = rdp_received(&conn2, sent1.buf[0], sent1.len[0]);
+    assert(res);
+    assert(rcvd == sizeof(v));
+    sent1.count = 0;
+    sent2.count = 0;
+
+    printf("*****\n");
+    close_connecions();
+    assert(conn1.state == RDP_CLOSED);
+
+    // Port above 15 doesn't fit compact header
+    init_connections(RDP_MAX_SEGMENT_SIZE, RDP_MAX_SEGMENT_SIZE);
+    rdp_set_compact_header(&conn1, tmp1);
+    rdp_set_compact_header(&conn2, tmp2);
+    res = rdp_listen(&conn2, 17);
+    assert(res);
+    res = rdp_connect(&conn1, 2, 17);
+    assert(res);
+    rdp_received(&conn2, outbuf1, RDP_MAX_SEGMENT_SIZE);
+    rdp_received(&conn1, outbuf2, RDP_MAX_SEGMENT_SIZE);
+    rdp_received(&conn2, outbuf1, RDP_MAX_SEGMENT_SIZE);
+    assert(conn1.state == RDP_OPEN);
+    assert(conn2.state == RDP_OPEN);
+    assert(!conn1.compact.enabled);
+    assert(!conn2.compact.enabled);
+    assert(!rdp_package_compact(outbuf1));
+    close_connecions();
+    assert(conn1.state == RDP_CLOSED);
+}
 
 int main(void)
 {
@@ -772,5 +2367,31 @@ int main(void)
     test_data_send_keepalive_1();
     test_data_send_keepalive_2();
     test_data_send_keepalive_3();
+    test_data_send_window();
+    test_data_send_eack();
+    test_data_send_eack_stale();
+    test_rtt_estimation();
+    test_congestion_control();
+    test_fast_retransmit();
+    test_delayed_ack();
+    test_piggyback_ack();
+    test_max_segment_size();
+    test_pmtu_probing();
+    test_message_send();
+    test_stream();
+    test_send_queue();
+    test_flow_control();
+    test_unordered_delivery();
+    test_partial_reliability();
+    test_fec();
+    test_pacing();
+    test_coalescing();
+    test_zero_rtt();
+    test_graceful_close();
+    test_fast_recycle();
+    test_sequence_wrap();
+    test_session_migration();
+    test_channels();
+    test_compact_header();
     return 0;
 }
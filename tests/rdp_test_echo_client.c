@@ -16,6 +16,7 @@ struct sockaddr_in servaddr;;
 uint8_t inbuffer[RDP_MAX_SEGMENT_SIZE];
 uint8_t outbuffer[RDP_MAX_SEGMENT_SIZE];
 uint8_t received[RDP_MAX_SEGMENT_SIZE];
+uint8_t winbuffer[RDP_WINDOW_BUFFER_SIZE(RDP_MAX_SEGMENT_SIZE)];
 size_t lenrecv;
 
 int cnctd = 0;
@@ -90,7 +91,7 @@ int main(void)
 
     sendto(fd, "xxx", 3, MSG_CONFIRM, (struct sockaddr *) &servaddr, sizeof(servaddr));
 
-    rdp_init_connection(&conn, outbuffer, received);
+    rdp_init_connection(&conn, outbuffer, received, winbuffer, RDP_MAX_SEGMENT_SIZE);
     set_cbs(&conn);
     rdp_connect(&conn, 1, 1);
 
@@ -18,6 +18,7 @@ uint8_t received[RDP_MAX_SEGMENT_SIZE];
 size_t lenrecv;
 uint8_t inbuffer[RDP_MAX_SEGMENT_SIZE];
 uint8_t outbuffer[RDP_MAX_SEGMENT_SIZE];
+uint8_t winbuffer[RDP_WINDOW_BUFFER_SIZE(RDP_MAX_SEGMENT_SIZE)];
 
 int cnctd = 0;
 
@@ -96,8 +97,9 @@ int main(void)
 
     struct rdp_connection_s conn;
 
-    rdp_init_connection(&conn, outbuffer, received);
+    rdp_init_connection(&conn, outbuffer, received, winbuffer, RDP_MAX_SEGMENT_SIZE);
     set_cbs(&conn);
+    rdp_set_fast_recycle(&conn, true);
     rdp_listen(&conn, 1);
 
     while (true)